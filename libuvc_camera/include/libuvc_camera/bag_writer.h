@@ -0,0 +1,100 @@
+#pragma once
+
+#include <deque>
+#include <set>
+#include <string>
+
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace libuvc_camera {
+
+// Writes the driver's outgoing messages to a bag from a background thread.
+// The frame path only queues a reference to the (immutable, already
+// published) message; serialization and disk I/O happen on the writer
+// thread. Bags can be split by size into name_0.bag, name_1.bag, ... with
+// the oldest deleted beyond max_splits.
+class BagWriter {
+public:
+  struct Options {
+    Options()
+      : split_bytes(0), max_splits(0),
+        compression(rosbag::compression::Uncompressed), queue_size(8) {}
+
+    std::string path;       // With or without .bag
+    uint64_t split_bytes;   // 0 for a single bag
+    int max_splits;         // Bags to keep when splitting; 0 keeps all
+    rosbag::compression::CompressionType compression;
+    std::set<std::string> outputs;  // Output names to record, e.g. image_raw
+    int queue_size;         // Messages waiting for the writer
+  };
+
+  BagWriter();
+  ~BagWriter();
+
+  static bool ParseCompression(const std::string &name,
+                               rosbag::compression::CompressionType *compression);
+
+  bool Open(const Options &options);
+  void Close();
+  bool IsOpen() const { return open_; }
+
+  // Whether messages for an output (such as "image_raw") are recorded.
+  bool Wants(const std::string &output) const {
+    return open_ && options_.outputs.count(output);
+  }
+
+  // Queues msg for topic, unless the output isn't recorded or the queue is
+  // full. msg must not be modified afterwards.
+  template <class M>
+  void Write(const std::string &output, const std::string &topic,
+             const ros::Time &time, const boost::shared_ptr<M> &msg) {
+    if (!Wants(output))
+      return;
+    Enqueue(boost::bind(&BagWriter::WriteMessage<M>, this, topic, time, msg));
+  }
+
+private:
+  typedef boost::function<void()> Task;
+
+  void Enqueue(const Task &task);
+  void WriterLoop();
+  bool OpenBag();
+  void CloseBag();
+
+  template <class M>
+  void WriteMessage(const std::string &topic, const ros::Time &time,
+                    const boost::shared_ptr<M> &msg) {
+    if (!bag_open_)
+      return;
+    bag_.write(topic, time, *msg);
+    if (options_.split_bytes && bag_.getSize() >= options_.split_bytes) {
+      CloseBag();
+      OpenBag();
+    }
+  }
+
+  Options options_;
+  bool open_;
+
+  boost::mutex mutex_;
+  boost::condition_variable queue_cond_;
+  std::deque<Task> queue_;
+  bool stop_;
+  unsigned long drops_;
+  boost::thread writer_;
+
+  // Owned by the writer thread
+  rosbag::Bag bag_;
+  bool bag_open_;
+  int split_index_;
+  std::deque<std::string> split_paths_;
+};
+
+};
@@ -7,25 +7,50 @@
 #include <image_transport/camera_publisher.h>
 #include <dynamic_reconfigure/server.h>
 #include <camera_info_manager/camera_info_manager.h>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 
+#include <libuvc_camera/FrameStart.h>
+#include <libuvc_camera/ImageStrip.h>
 #include <libuvc_camera/UVCCameraConfig.h>
+#include <libuvc_camera/bag_writer.h>
+#include <libuvc_camera/color_conversion.h>
+#include <libuvc_camera/decode_pool.h>
+#include <libuvc_camera/frame_arena.h>
+#include <libuvc_camera/frame_recorder.h>
+#include <libuvc_camera/h264_encoder.h>
+#include <libuvc_camera/jpeg_encoder.h>
+#include <libuvc_camera/mjpeg_decoder.h>
+#include <libuvc_camera/motion_detector.h>
+#include <libuvc_camera/software_isp.h>
+#include <libuvc_camera/frame_tracer.h>
+#include <libuvc_camera/payload_capture.h>
 
 namespace libuvc_camera {
 
 class CameraDriver {
 public:
-  CameraDriver(ros::NodeHandle nh, ros::NodeHandle priv_nh);
+  // use_decode_pool is the default of ~use_decode_pool.
+  CameraDriver(ros::NodeHandle nh, ros::NodeHandle priv_nh, bool use_decode_pool = false);
   ~CameraDriver();
 
   bool Start();
+  // Start using a context shared with other drivers; the caller keeps
+  // ownership and must outlive this driver's Stop().
+  bool Start(uvc_context_t *shared_ctx);
   void Stop();
 
+  // Offline replay: feeds frames rebuilt from a payload capture through the
+  // normal conversion and publishing path, without opening a device.
+  void StartReplay(int width, int height);
+  void ReplayFrame(uvc_frame_t *frame);
+
 private:
   enum State {
     kInitial = 0,
     kStopped = 1,
     kRunning = 2,
+    kReplaying = 3,
   };
 
   // Flags controlling whether the sensor needs to be stopped (or reopened) when changing settings
@@ -39,6 +64,14 @@ private:
   // Accept a reconfigure request from a client
   void ReconfigureCallback(UVCCameraConfig &config, uint32_t level);
   enum uvc_frame_format GetVideoMode(std::string vmode);
+  // Frame format of the format descriptor selected by a negotiated ctrl
+  enum uvc_frame_format GetNegotiatedFormat(const uvc_stream_ctrl_t &ctrl);
+  // (Re)allocates rgb_frame_ and the raw ring for a frame size, from the
+  // huge page arena when ~huge_pages is set
+  void AllocateFrameBuffers(int width, int height, size_t raw_frame_bytes);
+  // Sets yuyv_kernel_ and yuyv_bgra_kernel_ from ~conversion_kernel,
+  // benchmarking if it's "auto"
+  void SelectYuyvKernel(int width, int height);
   // Accept changes in values of automatically updated controls
   void AutoControlsCallback(enum uvc_status_class status_class,
                             int event,
@@ -54,6 +87,42 @@ private:
   // Accept a new image frame from the camera
   void ImageCallback(uvc_frame_t *frame);
   static void ImageCallbackAdapter(uvc_frame_t *frame, void *ptr);
+  // Publish (and record) an encoded H.264 frame; called on the encoder thread
+  void PublishH264(const sensor_msgs::CompressedImage::Ptr &packet);
+  // Publish (and record) a JPEG-compressed frame; called on the encoder thread
+  void PublishJpeg(const sensor_msgs::CompressedImage::Ptr &packet);
+  // Announce the frame following one that just completed
+  void PublishFrameStart(const UVCCameraConfig &config, uvc_frame_t *frame,
+                         ros::Time timestamp);
+  // Convert a frame and publish it
+  void ProcessFrame(uvc_frame_t *frame, ros::Time timestamp, FrameTraceRecord *trace);
+  // Runs ProcessFrame on a decode pool worker, then recycles the frame copy
+  void DecodeTask(uvc_frame_t *frame, ros::Time timestamp, FrameTraceRecord *trace);
+  // Whether a frame captured at timestamp is past config_.max_frame_age
+  bool IsStale(const UVCCameraConfig &config, ros::Time timestamp,
+               unsigned long *drop_counter);
+  // Copy of config_ for the frame threads, which don't hold mutex_
+  UVCCameraConfig ConfigSnapshot();
+  // Whether a frame differs enough from the last published one, or is due
+  // as a keep-alive, to be published under config_.motion_threshold.
+  // *sampled is set when the frame's sample may become the reference.
+  bool HasMotion(const UVCCameraConfig &config, uvc_frame_t *frame,
+                 ros::Time timestamp, bool *sampled);
+  // Encoding frames of this format are published in, given
+  // config_.output_encoding
+  std::string OutputEncoding(const UVCCameraConfig &config, enum uvc_frame_format format);
+  // Updates the software ISP from config_; whether it applies to images of
+  // this encoding
+  bool ConfigureIsp(const UVCCameraConfig &config, const std::string &encoding);
+  // Color-corrects rows [row, row + rows) of a converted image
+  void CorrectRows(sensor_msgs::Image *image, int row, int rows);
+  // Publish the subscribed image_raw/levelN, halving image level by level
+  void PublishPyramid(const sensor_msgs::Image &image);
+  // Rows per strip for the current frame, or 0 when nobody wants strips
+  int StripRows();
+  // Publish rows [row, row + rows) of a (partly) converted image
+  void PublishStrip(const sensor_msgs::Image &image, int row, int rows, uint32_t sequence,
+                    FrameTraceRecord *trace);
 
   ros::NodeHandle nh_, priv_nh_;
 
@@ -61,15 +130,103 @@ private:
   boost::recursive_mutex mutex_;
 
   uvc_context_t *ctx_;
+  bool owns_ctx_;
   uvc_device_t *dev_;
   uvc_device_handle_t *devh_;
   uvc_frame_t *rgb_frame_;
+  MjpegDecoder mjpeg_decoder_;
+
+  // YUYV conversion kernel; ~conversion_kernel is "auto" to benchmark the
+  // candidates at OpenCamera, or a kernel name to force one.
+  std::string conversion_kernel_;
+  std::string conversion_plan_cache_;
+  YuyvKernel yuyv_kernel_;
+  // Kernel for the 4-byte outputs, which may be switched to while streaming
+  YuyvKernel yuyv_bgra_kernel_;
+
+  // Set when conversion runs on the shared decode pool instead of libuvc's
+  // callback thread. Frames are copied into the raw ring before queueing.
+  DecodePool::StrandPtr decode_strand_;
+  std::vector<uvc_frame_t*> raw_frames_;
+  std::vector<uvc_frame_t*> free_raw_frames_;
+  boost::mutex raw_frames_mutex_;
+  unsigned long decode_queue_drops_;
+
+  // Backs rgb_frame_ and the raw ring (the frames libuvc's conversions and
+  // the decode pool read) when ~huge_pages is set; every published message
+  // is still a heap std::vector. Frames using it don't own their data, and
+  // raw_frame_bytes_ is each raw slot's size.
+  bool use_huge_pages_;
+  FrameArena arena_;
+  size_t raw_frame_bytes_;
+
+  // Frames dropped for exceeding max_frame_age before conversion/publishing
+  unsigned long stale_convert_drops_;
+  unsigned long stale_publish_drops_;
+
+  // Motion gating state; the thumbnail holds 1/8 scale MJPEG luma
+  MotionDetector motion_detector_;
+  std::vector<uint8_t> motion_thumbnail_;
+  ros::Time last_motion_publish_;
+
+  // Software color correction, enabled by config_.isp. The matrix comes
+  // from ~isp_color_matrix, as dynamic_reconfigure has no lists.
+  SoftwareIsp software_isp_;
+  std::vector<double> isp_color_matrix_;
+
+  // Per-frame timing records, enabled by ~trace_file
+  FrameTracer tracer_;
+
+  // Raw streaming transfers, recorded when ~payload_capture_file is set
+  std::string payload_capture_file_;
+  PayloadCapture payload_capture_;
+
+  // Compressed recording of uncompressed frames, enabled by ~record_file
+  FrameRecorder recorder_;
+
+  // In-process recording of published messages, enabled by ~bag_file
+  BagWriter bag_writer_;
+  std::string image_topic_, camera_info_topic_;
+
+  // H.264 on image_raw/h264, enabled by ~h264
+  H264Encoder h264_encoder_;
+  ros::Publisher h264_pub_;
+  std::string h264_topic_;
+  bool h264_had_subscribers_;
+
+  // JPEG straight from YUV on image_jpeg/compressed, enabled by ~jpeg
+  JpegEncoder jpeg_encoder_;
+  ros::Publisher jpeg_pub_;
+  std::string jpeg_topic_;
 
   image_transport::ImageTransport it_;
   image_transport::CameraPublisher cam_pub_;
 
-  dynamic_reconfigure::Server<UVCCameraConfig>* config_server_;
+  // Published rows are padded to a step that is a multiple of ~row_alignment
+  // bytes (1 = packed). This aligns every row relative to the first row only:
+  // sensor_msgs/Image's std::vector decides where the first row starts.
+  int row_alignment_;
+
+  // Partial frames on image_raw/strips, enabled by ~strip_rows
+  int strip_rows_;
+  ros::Publisher strip_pub_;
+
+  // Halved images on image_raw/level1..N, N set by ~pyramid_levels
+  std::vector<image_transport::Publisher> pyramid_pubs_;
+
+  // Next-frame announcements on image_raw/frame_start. frame_period_ is a
+  // running average of the time between frame callbacks.
+  ros::Publisher frame_start_pub_;
+  ros::Time last_frame_time_;
+  double frame_period_;
+
+  // Bound to this driver and mutex_; torn down first in ~CameraDriver so no
+  // reconfigure call can reach a destroyed driver.
+  boost::scoped_ptr<dynamic_reconfigure::Server<UVCCameraConfig> > config_server_;
   dynamic_reconfigure::Server<UVCCameraConfig>::CallbackType dynamic_reconfigure_cb_;
+  // config_ and config_changed_ are only touched under config_mutex_; the
+  // frame and status threads can't take mutex_ (see ProcessFrame).
+  boost::mutex config_mutex_;
   UVCCameraConfig config_;
   bool config_changed_;
   bool creation_;
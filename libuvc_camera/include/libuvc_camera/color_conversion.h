@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace libuvc_camera {
+
+// Ways of turning a YUYV frame into a bgr8 image. All of them produce the same
+// pixels as libuvc's uvc_yuyv2bgr (fixed-point BT.601, full-range luma).
+enum YuyvKernel {
+  kYuyvKernelUvc = 0,     // uvc_yuyv2bgr into a scratch frame, then a copy
+  kYuyvKernelScalar = 1,  // Portable kernel writing straight into the image
+  kYuyvKernelSse2 = 2,    // SSE2 kernel writing straight into the image
+  kNumYuyvKernels = 3,
+};
+
+const char *YuyvKernelName(YuyvKernel kernel);
+bool ParseYuyvKernel(const std::string &name, YuyvKernel *kernel);
+// Whether this build and CPU can run the kernel.
+bool YuyvKernelSupported(YuyvKernel kernel);
+
+// Converts width x height YUYV pixels to bgr8 using one of the direct
+// kernels (anything but kYuyvKernelUvc). width must be even.
+void YuyvToBgr(YuyvKernel kernel,
+               const uint8_t *src, size_t src_step,
+               uint8_t *dst, size_t dst_step,
+               int width, int height);
+
+// Converts width x height YUYV pixels to bgra8, or rgba8 with swap_red_blue,
+// with alpha 255. kYuyvKernelUvc has no 4-byte form and runs the scalar
+// kernel. width must be even.
+void YuyvToBgra(YuyvKernel kernel,
+                const uint8_t *src, size_t src_step,
+                uint8_t *dst, size_t dst_step,
+                int width, int height, bool swap_red_blue);
+
+// Copies the luma of width x height packed 4:2:2 pixels (YUYV, or UYVY with
+// uyvy) to mono8.
+void PackedToMono8(const uint8_t *src, size_t src_step, bool uyvy,
+                   uint8_t *dst, size_t dst_step, int width, int height);
+
+// Widens 3-byte pixels to 4 with alpha 255, swapping the first and third
+// bytes if asked to. src may equal dst when both have the same step, e.g. to
+// widen rows decoded into the front of a 4-byte image.
+void ExpandToFourChannels(const uint8_t *src, size_t src_step,
+                          uint8_t *dst, size_t dst_step,
+                          int width, int height, bool swap_red_blue);
+
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+#include <libuvc_camera/color_conversion.h>
+
+namespace libuvc_camera {
+
+// Picks the fastest YUYV to bgr8 (or, with four_channels, bgra8/rgba8)
+// kernel for a frame size by timing every supported kernel on synthetic
+// frames of that size. Choices are cached per host, CPU model, output and
+// frame size in cache_path, so only the first start pays for the benchmark.
+// An empty cache_path disables the cache. Benchmarks in one process run one
+// at a time, so drivers starting together don't time each other.
+YuyvKernel PlanYuyvKernel(int width, int height, bool four_channels,
+                          const std::string &cache_path);
+
+// $ROS_HOME/libuvc_camera_plans, or ~/.ros/libuvc_camera_plans
+std::string DefaultPlanCachePath();
+
+};
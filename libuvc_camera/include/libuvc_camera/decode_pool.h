@@ -0,0 +1,76 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace libuvc_camera {
+
+// Process-wide pool of decode/convert workers shared by every CameraDriver.
+//
+// Each camera submits its frames to its own strand. Tasks on a strand run one
+// at a time and in submission order; different strands run in parallel. A
+// strand with work is queued on one worker, and idle workers steal strands
+// queued on busy ones. A strand's weight is the number of tasks it may run
+// before yielding its worker to the next queued strand.
+class DecodePool {
+public:
+  typedef boost::function<void()> Task;
+
+  class Strand {
+  public:
+    explicit Strand(int weight) : weight_(weight), scheduled_(false) {}
+
+  private:
+    friend class DecodePool;
+
+    const int weight_;
+    boost::mutex mutex_;
+    boost::condition_variable idle_;
+    std::deque<Task> tasks_;
+    bool scheduled_;  // Queued on a worker or running
+  };
+  typedef boost::shared_ptr<Strand> StrandPtr;
+
+  // Returns the shared pool. It is created on first use with num_threads
+  // workers, or one per core if num_threads is zero; later values are ignored.
+  static DecodePool &Instance(int num_threads = 0);
+
+  StrandPtr CreateStrand(int weight);
+  void Submit(const StrandPtr &strand, const Task &task);
+  // Blocks until every task submitted to the strand has run.
+  void Flush(const StrandPtr &strand);
+
+  int NumThreads() const { return (int) workers_.size(); }
+
+private:
+  struct Worker {
+    boost::mutex mutex;
+    std::deque<StrandPtr> strands;
+  };
+
+  explicit DecodePool(int num_threads);
+
+  void Schedule(size_t worker, const StrandPtr &strand);
+  bool PopStrand(size_t worker, StrandPtr *strand);
+  void RunStrand(size_t worker, const StrandPtr &strand);
+  void WorkerLoop(size_t worker);
+
+  std::vector<boost::shared_ptr<Worker> > workers_;
+  boost::thread_group threads_;
+
+  boost::mutex wake_mutex_;
+  boost::condition_variable wake_;
+  // Strands queued across all workers; changed together with a queue, under
+  // its worker mutex (taken first) and wake_mutex_
+  size_t pending_;
+
+  volatile unsigned int next_worker_;
+};
+
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace libuvc_camera {
+
+// One mapping for the driver's long-lived raw frame buffers, preferably with
+// 2 MB pages so that touching a 4K frame costs a handful of TLB entries
+// instead of thousands. Blocks are carved off in order and only returned all
+// at once by Release(). Buffers handed to ROS (images, strips) and libjpeg's
+// working memory can't come from here; they use their own allocators.
+class FrameArena {
+public:
+  enum Mode {
+    kNone = 0,             // Nothing mapped
+    kHugeTlb = 1,          // Explicit huge pages (MAP_HUGETLB)
+    kTransparentHuge = 2,  // Regular mapping with MADV_HUGEPAGE
+    kRegularPages = 3,     // Huge pages unavailable
+  };
+
+  static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+  FrameArena();
+  ~FrameArena();
+
+  // Maps and prefaults at least `bytes`, trying explicit huge pages first,
+  // then transparent huge pages, then regular pages.
+  bool Allocate(size_t bytes);
+  void Release();
+
+  // Returns a 64-byte aligned block, or NULL when the arena is exhausted.
+  void *Take(size_t bytes);
+
+  Mode GetMode() const { return mode_; }
+  size_t Size() const { return size_; }
+  static const char *ModeName(Mode mode);
+
+private:
+  uint8_t *base_;
+  size_t size_;
+  size_t used_;
+  Mode mode_;
+};
+
+};
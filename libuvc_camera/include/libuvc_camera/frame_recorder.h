@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <libuvc/libuvc.h>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace libuvc_camera {
+
+// Layout of a frame recording: a FrameRecordingHeader, then one
+// FrameRecordingEntry per frame followed by its compressed bytes. Frames
+// are written in the order compression finishes, which can differ from the
+// capture order. Close() appends the index, a FrameRecordingIndexEntry per
+// frame sorted by sequence, and a FrameRecordingTrailer; a file without the
+// trailer can still be read by walking the entries from the start, as
+// record_decode does.
+static const char kFrameRecordingMagic[8] = {'U', 'V', 'C', 'F', 'R', 'A', 'M', 'E'};
+static const char kFrameRecordingIndexMagic[8] = {'U', 'V', 'C', 'I', 'N', 'D', 'E', 'X'};
+static const uint32_t kFrameRecordingVersion = 1;
+
+enum FrameRecordingCodec {
+  kFrameRecordingLz4 = 1,
+  kFrameRecordingZstd = 2,
+};
+
+struct FrameRecordingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t codec;  // FrameRecordingCodec
+  uint8_t reserved[48];
+};
+
+struct FrameRecordingEntry {
+  uint64_t stamp_ns;
+  uint32_t sequence;
+  uint32_t frame_format;  // enum uvc_frame_format
+  uint32_t width;
+  uint32_t height;
+  uint32_t step;
+  uint32_t raw_bytes;
+  uint32_t compressed_bytes;
+  uint32_t reserved;
+};
+
+struct FrameRecordingIndexEntry {
+  uint64_t stamp_ns;
+  uint64_t offset;  // Of the frame's FrameRecordingEntry
+  uint32_t sequence;
+  uint32_t reserved;
+};
+
+struct FrameRecordingTrailer {
+  char magic[8];
+  uint64_t index_offset;
+  uint64_t num_frames;
+};
+
+// Losslessly compresses uncompressed frames (YUYV, Bayer, Y16, ...) with LZ4
+// or Zstd on its own worker threads and writes them to a recording. Frames
+// are copied on Submit; when every buffer is busy the frame is dropped and
+// counted rather than stalling the caller.
+class FrameRecorder {
+public:
+  FrameRecorder();
+  ~FrameRecorder();
+
+  static bool CodecSupported(FrameRecordingCodec codec);
+  static bool ParseCodec(const std::string &name, FrameRecordingCodec *codec);
+
+  // level is the Zstd level, or the LZ4 acceleration factor.
+  bool Open(const std::string &path, FrameRecordingCodec codec, int level,
+            int num_threads, int queue_depth);
+  void Close();
+  bool IsOpen() const { return file_ != NULL; }
+
+  void Submit(uvc_frame_t *frame, uint64_t stamp_ns);
+  // Frames older than this when a worker gets to them are dropped and
+  // counted; zero records every frame.
+  void SetMaxFrameAge(double seconds);
+
+private:
+  struct Job {
+    FrameRecordingEntry entry;
+    std::vector<uint8_t> raw;
+    std::vector<uint8_t> compressed;
+  };
+
+  void WorkerLoop();
+  bool Compress(void *context, Job *job);
+  void Write(Job *job, double compress_seconds);
+  void ReportStats();
+
+  FILE *file_;
+  FrameRecordingCodec codec_;
+  int level_;
+  int num_threads_;
+
+  boost::mutex mutex_;
+  boost::condition_variable queue_cond_;
+  std::deque<Job*> queue_;
+  std::vector<Job*> free_jobs_;
+  std::vector<Job*> jobs_;
+  bool stop_;
+  double max_frame_age_;
+  unsigned long stale_drops_;
+  boost::thread_group workers_;
+
+  // File, index and statistics; separate from the queue so that Submit
+  // never waits for a write.
+  boost::mutex write_mutex_;
+  std::vector<FrameRecordingIndexEntry> index_;
+  uint64_t write_offset_;
+  unsigned long frames_;
+  unsigned long drops_;
+  uint64_t raw_bytes_;
+  uint64_t compressed_bytes_;
+  double compress_seconds_;
+  double report_start_;
+  double report_compress_seconds_;
+  unsigned long report_frames_;
+};
+
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+namespace libuvc_camera {
+
+// On-disk layout of a frame trace file: a FrameTraceHeader followed by
+// `capacity` FrameTraceRecords used as a ring. All times are CLOCK_MONOTONIC
+// nanoseconds, the clock libuvc stamps frames with; zero means the stage was
+// never reached. usb_receive_ns is always zero with libuvc older than 0.0.7,
+// which doesn't stamp frames.
+static const char kFrameTraceMagic[8] = {'U', 'V', 'C', 'T', 'R', 'A', 'C', 'E'};
+static const uint32_t kFrameTraceVersion = 3;
+
+struct FrameTraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;
+  uint32_t reserved0;
+  uint64_t next_index;  // Number of records ever claimed
+  uint8_t reserved1[32];
+};
+
+struct FrameTraceRecord {
+  uint64_t index;  // Claim index + 1, written last; zero while in flight
+  uint64_t usb_receive_ns;
+  uint64_t callback_ns;
+  uint64_t convert_start_ns;
+  uint64_t convert_end_ns;
+  uint64_t publish_end_ns;
+  uint32_t sequence;
+  uint32_t payload_bytes;
+  uint64_t claimed_index;  // Claim index + 1, written by Begin
+  uint64_t first_strip_ns;  // First image_strip of the frame published
+};
+
+// Writes one FrameTraceRecord per frame into a preallocated, memory-mapped
+// ring file. Recording a frame touches only the mapping: no allocation and
+// no system calls (clock_gettime is served by the vDSO).
+class FrameTracer {
+public:
+  FrameTracer();
+  ~FrameTracer();
+
+  bool Open(const std::string &path, uint32_t capacity);
+  void Close();
+  bool IsOpen() const { return header_ != NULL; }
+
+  // Claims the next ring slot; returns NULL when tracing is off.
+  FrameTraceRecord *Begin(uint32_t sequence, uint32_t payload_bytes,
+                          uint64_t usb_receive_ns);
+  // Publishes a record claimed by Begin.
+  void Commit(FrameTraceRecord *record);
+
+  static uint64_t Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+private:
+  FrameTraceHeader *header_;
+  FrameTraceRecord *records_;
+  size_t map_size_;
+};
+
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <libuvc/libuvc.h>
+#include <ros/ros.h>
+#include <sensor_msgs/CompressedImage.h>
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace libuvc_camera {
+
+// Low-latency software H.264 encoding of YUYV/UYVY frames on a background
+// thread. Frames go straight from packed 4:2:2 to the encoder's I420 input,
+// with no BGR step. Only the newest submitted frame is kept while the
+// encoder is busy. Each encoded frame is handed to the packet callback as a
+// CompressedImage with format "h264" holding Annex B NAL units; keyframes
+// repeat SPS/PPS so decoders can join at any keyframe.
+class H264Encoder {
+public:
+  typedef boost::function<void(const sensor_msgs::CompressedImage::Ptr&)> PacketCallback;
+
+  struct Options {
+    Options() : bitrate_kbps(2000), keyframe_interval(30), threads(1) {}
+
+    int bitrate_kbps;
+    int keyframe_interval;  // Frames between keyframes
+    int threads;
+  };
+
+  H264Encoder();
+  ~H264Encoder();
+
+  static bool Supported();
+  static bool CanEncode(enum uvc_frame_format format) {
+    return format == UVC_FRAME_FORMAT_YUYV || format == UVC_FRAME_FORMAT_UYVY;
+  }
+
+  bool Start(const Options &options, const PacketCallback &callback);
+  void Stop();
+  bool IsRunning() const { return running_; }
+
+  // Copies the frame for encoding. frame_rate is the negotiated rate, which
+  // rate control budgets the bitrate by; the encoder restarts when it or
+  // the frame size changes. force_keyframe makes it an IDR frame, e.g. when
+  // the first subscriber arrives. I420 needs even widths and heights; other
+  // frames are skipped.
+  void Submit(uvc_frame_t *frame, const std::string &frame_id, ros::Time stamp,
+              double frame_rate, bool force_keyframe);
+  // Frames older than this when the encoder gets to them are skipped;
+  // zero encodes every frame.
+  void SetMaxFrameAge(double seconds);
+
+private:
+  struct Input {
+    std::vector<uint8_t> data;
+    enum uvc_frame_format format;
+    int width;
+    int height;
+    double frame_rate;
+    std::string frame_id;
+    ros::Time stamp;
+    bool force_keyframe;
+  };
+
+  void EncodeLoop();
+  bool OpenEncoder(int width, int height, double frame_rate);
+  void CloseEncoder();
+  void Encode(const Input &input);
+
+  Options options_;
+  PacketCallback callback_;
+  bool running_;
+
+  boost::mutex mutex_;
+  boost::condition_variable pending_cond_;
+  Input pending_;
+  bool has_pending_;
+  bool stop_;
+  unsigned long drops_;
+  double max_frame_age_;
+  boost::thread thread_;
+
+  // Owned by the encoder thread
+  unsigned long stale_drops_;
+  bool force_next_keyframe_;  // A skipped stale frame asked for a keyframe
+  void *encoder_;  // x264_t
+  void *picture_;  // x264_picture_t, I420 input allocated with the encoder
+  int encoder_width_, encoder_height_;
+  double encoder_frame_rate_;
+  int64_t pts_;
+  Input current_;
+};
+
+};
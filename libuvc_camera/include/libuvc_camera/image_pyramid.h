@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace libuvc_camera {
+
+// Halves an image of 8-bit channels with a rounded 2x2 box filter into a
+// (width / 2) x (height / 2) image; an odd last row or column is dropped.
+// One- and four-channel images (mono8, bgra8/rgba8) take an SSE2 path.
+void HalveImage(const uint8_t *src, size_t src_step, int width, int height,
+                int channels, uint8_t *dst, size_t dst_step);
+
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <libuvc/libuvc.h>
+#include <ros/ros.h>
+#include <sensor_msgs/CompressedImage.h>
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace libuvc_camera {
+
+// JPEG-compresses YUYV/UYVY frames on a background thread through libjpeg's
+// raw data interface: the 4:2:2 planes go to the DCT as they are, without
+// converting to BGR and back to YCbCr. Only the newest submitted frame is
+// kept while the encoder is busy. Output is a CompressedImage in the format
+// image_transport's compressed plugin produces for bgr8 images, so its
+// subscribers decode it directly.
+class JpegEncoder {
+public:
+  typedef boost::function<void(const sensor_msgs::CompressedImage::Ptr&)> PacketCallback;
+
+  JpegEncoder();
+  ~JpegEncoder();
+
+  static bool Supported();
+  static bool CanEncode(enum uvc_frame_format format) {
+    return format == UVC_FRAME_FORMAT_YUYV || format == UVC_FRAME_FORMAT_UYVY;
+  }
+
+  bool Start(int quality, const PacketCallback &callback);
+  void Stop();
+  bool IsRunning() const { return running_; }
+
+  // Copies the frame for encoding.
+  void Submit(uvc_frame_t *frame, const std::string &frame_id, ros::Time stamp);
+  // Frames older than this when the encoder gets to them are skipped;
+  // zero encodes every frame.
+  void SetMaxFrameAge(double seconds);
+
+  // Compresses one packed 4:2:2 frame into *jpeg; used by the encoder thread.
+  static bool Compress(const uint8_t *src, enum uvc_frame_format format,
+                       int width, int height, int quality,
+                       std::vector<uint8_t> *jpeg);
+
+private:
+  struct Input {
+    std::vector<uint8_t> data;
+    enum uvc_frame_format format;
+    int width;
+    int height;
+    std::string frame_id;
+    ros::Time stamp;
+  };
+
+  void EncodeLoop();
+
+  int quality_;
+  PacketCallback callback_;
+  bool running_;
+
+  boost::mutex mutex_;
+  boost::condition_variable pending_cond_;
+  Input pending_;
+  bool has_pending_;
+  bool stop_;
+  unsigned long drops_;
+  double max_frame_age_;
+  boost::thread thread_;
+
+  // Owned by the encoder thread
+  Input current_;
+  unsigned long stale_drops_;
+};
+
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace libuvc_camera {
+
+// Long-lived libjpeg decompressor for one camera's MJPEG stream. Unlike
+// uvc_mjpeg2rgb, which sets up a decompressor and its error handling and
+// injects the Huffman tables for every frame, this one is created once with
+// the standard tables preinstalled and decodes straight into the caller's
+// image. Not thread-safe; each camera decodes on one thread at a time.
+class MjpegDecoder {
+public:
+  MjpegDecoder();
+  ~MjpegDecoder();
+
+  static bool Supported();
+
+  // Decodes to yuv422 (UYVY order) straight from the JPEG's YCbCr planes,
+  // without color conversion. Needs 2x1 (4:2:2) or 2x2 (4:2:0) sampling;
+  // 4:2:0 chroma is repeated on both rows of each pair.
+  bool DecodeYuv422(const uint8_t *jpeg, size_t jpeg_bytes,
+                    int width, int height, uint8_t *dst, size_t dst_step);
+
+  // Decodes only the luma to mono8; chroma is entropy-decoded (it has to be
+  // skipped over) but never transformed or upsampled.
+  bool DecodeMono8(const uint8_t *jpeg, size_t jpeg_bytes,
+                   int width, int height, uint8_t *dst, size_t dst_step);
+
+  // Decodes the luma at 1/8 scale, which needs only each block's DC
+  // coefficient, into *luma; *width and *height get the reduced size.
+  bool DecodeLumaThumbnail(const uint8_t *jpeg, size_t jpeg_bytes,
+                           std::vector<uint8_t> *luma, int *width, int *height);
+
+  // Decodes to rgb8, like uvc_mjpeg2rgb.
+  bool DecodeRgb8(const uint8_t *jpeg, size_t jpeg_bytes,
+                  int width, int height, uint8_t *dst, size_t dst_step);
+
+  // Decodes to bgra8, or rgba8 with swap_red_blue, with alpha 255. libjpeg-turbo
+  // writes the 4-byte pixels itself; other libjpegs decode rgb8 and widen it.
+  bool DecodeBgra8(const uint8_t *jpeg, size_t jpeg_bytes,
+                   int width, int height, bool swap_red_blue,
+                   uint8_t *dst, size_t dst_step);
+
+private:
+  // Decodes to a libjpeg output color space (J_COLOR_SPACE).
+  bool DecodeScanlines(const uint8_t *jpeg, size_t jpeg_bytes,
+                       int width, int height, int color_space,
+                       uint8_t *dst, size_t dst_step);
+
+  struct State;
+  State *state_;
+};
+
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace libuvc_camera {
+
+// Cheap change metric for motion-gated publishing: luma sampled on a fixed
+// grid, compared by mean absolute difference against a reference sample
+// (normally the last published frame).
+class MotionDetector {
+public:
+  static const int kGridWidth = 64;
+  static const int kGridHeight = 48;
+
+  MotionDetector();
+
+  // Samples the grid from width x height luma values, pixel_stride bytes
+  // apart within rows of row_stride bytes.
+  void Sample(const uint8_t *luma, size_t pixel_stride, size_t row_stride,
+              int width, int height);
+
+  // Mean absolute difference of the last sample to the reference, in luma
+  // levels; negative when there is no reference yet.
+  double Difference() const;
+
+  // Makes the last sample the reference.
+  void Accept();
+  void Reset();
+
+private:
+  std::vector<uint8_t> current_;
+  std::vector<uint8_t> reference_;
+};
+
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <libuvc/libuvc.h>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace libuvc_camera {
+
+// Layout of a payload capture file: a PayloadCaptureHeader, then for every
+// completed streaming transfer a PayloadCaptureRecord, its isochronous packet
+// descriptors and finally the transfer buffer. Packet offsets are relative to
+// the start of the transfer buffer; bulk transfers have no descriptors.
+static const char kPayloadCaptureMagic[8] = {'U', 'V', 'C', 'P', 'A', 'Y', 'L', 'D'};
+static const uint32_t kPayloadCaptureVersion = 1;
+
+struct PayloadCaptureHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t frame_format;  // enum uvc_frame_format, once the first frame arrived
+  uint32_t width;
+  uint32_t height;
+  uint8_t reserved[40];
+};
+
+enum PayloadTransferType {
+  kPayloadTransferIso = 0,
+  kPayloadTransferBulk = 3,
+};
+
+struct PayloadCaptureRecord {
+  uint64_t timestamp_ns;
+  int32_t status;
+  uint8_t transfer_type;  // PayloadTransferType
+  uint8_t endpoint;
+  uint16_t reserved;
+  uint32_t num_packets;
+  uint32_t data_bytes;
+};
+
+struct PayloadCapturePacket {
+  int32_t status;
+  uint32_t offset;
+  uint32_t length;
+  uint32_t reserved;
+};
+
+// Records the raw streaming transfers of one device, as completed by the host
+// controller, using the Linux usbmon binary interface (/dev/usbmonN). This
+// sees exactly what libuvc's transfer callbacks see, including UVC payload
+// headers and per-packet status, without touching libuvc.
+class PayloadCapture {
+public:
+  PayloadCapture();
+  ~PayloadCapture();
+
+  bool Start(const std::string &path, int bus, int address);
+  void Stop();
+  bool IsRunning() const { return fd_ >= 0; }
+
+  // Records the stream format in the file header; only the first call counts.
+  void SetFormat(enum uvc_frame_format format, int width, int height);
+
+  unsigned long NumTransfers() const { return num_transfers_; }
+
+private:
+  void CaptureLoop();
+
+  int mon_fd_;
+  int fd_;
+  FILE *file_;
+  int bus_;
+  int address_;
+  volatile bool stop_;
+  volatile bool format_set_;
+  unsigned long num_transfers_;
+  boost::thread thread_;
+};
+
+// Rebuilds frames from UVC payloads the way libuvc does: packets with an error
+// status or the payload error bit are skipped, a frame ends at the EOF bit or
+// when the frame ID toggles with data pending.
+class PayloadAssembler {
+public:
+  typedef boost::function<void(uvc_frame_t*)> FrameCallback;
+
+  struct Stats {
+    unsigned long payloads;
+    unsigned long packet_errors;   // Non-zero isochronous packet status
+    unsigned long header_errors;   // Header longer than the payload
+    unsigned long error_bit;       // Payload header ERR bit set
+    unsigned long fid_toggles;     // Frame ended by FID toggle without EOF
+    unsigned long eof_frames;      // Frame ended by EOF
+    unsigned long overflows;       // Frame exceeded the buffer and was cut
+  };
+
+  PayloadAssembler(enum uvc_frame_format format, int width, int height,
+                   size_t max_frame_bytes, const FrameCallback &callback);
+
+  // Feeds one completed transfer as read from a capture file.
+  void ProcessTransfer(const PayloadCaptureRecord &record,
+                       const PayloadCapturePacket *packets,
+                       const uint8_t *data);
+  void ProcessPayload(const uint8_t *payload, size_t length);
+
+  const Stats &GetStats() const { return stats_; }
+
+private:
+  void EmitFrame();
+
+  FrameCallback callback_;
+  std::vector<uint8_t> buffer_;
+  size_t got_bytes_;
+  uint8_t fid_;
+  uint32_t sequence_;
+  uvc_frame_t frame_;
+  Stats stats_;
+};
+
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace libuvc_camera {
+
+// Color correction for cameras with poor on-board processing: per-channel
+// gains, a 3x3 color correction matrix and a gamma curve, applied in place to
+// rows that were just converted. Configure folds the gains into the matrix as
+// 16-bit fixed point and builds a gamma table. A pixel then costs a 3x3
+// multiply-add, done with SSE2 on 4-byte pixels, plus one table lookup per
+// channel; a diagonal matrix collapses to one lookup per channel.
+class SoftwareIsp {
+public:
+  struct Options {
+    Options();  // Identity: unit gains and matrix, gamma 1
+
+    double gains[3];   // Red, green, blue
+    double matrix[9];  // Row-major, RGB in and RGB out, applied after gains
+    double gamma;      // Output is input^(1 / gamma)
+  };
+
+  SoftwareIsp();
+
+  // Rebuilds the tables if the options differ from the current ones.
+  void Configure(const Options &options);
+
+  // Corrects width x height pixels of channels (3 or 4) bytes, rows step
+  // bytes apart. red_first is false for BGR orders; a fourth byte is left
+  // alone.
+  void Apply(uint8_t *pixels, size_t step, int width, int height,
+             int channels, bool red_first) const;
+
+private:
+  Options options_;
+  bool configured_;
+
+  // Whether the matrix has no cross terms, so channels_ alone do the work
+  bool diagonal_;
+  // channels_[c * 256 + v]: channel c's output for input v, diagonal only
+  std::vector<uint8_t> channels_;
+  // coefficients_[out * 3 + in]: matrix times gain, kCoefficientBits fixed
+  // point, limited to the int16 range
+  int16_t coefficients_[9];
+  // tone_[x]: gamma-corrected output for a matrix output x with
+  // kFractionBits fractional bits
+  std::vector<uint8_t> tone_;
+};
+
+};
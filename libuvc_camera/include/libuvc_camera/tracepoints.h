@@ -0,0 +1,32 @@
+#pragma once
+
+// Static (USDT) tracepoints for bpftrace, perf, SystemTap and LTTng userspace
+// probes, all under the "libuvc_camera" provider, e.g.
+//
+//   bpftrace -e 'usdt:./camera_node:libuvc_camera:drop { printf("%d %s\n", arg0, str(arg1)); }'
+//
+// Each probe site is a single nop until a tracer attaches. Without
+// LIBUVC_CAMERA_USDT (no <sys/sdt.h>) they compile to nothing.
+//
+//   frame_arrival(sequence, bytes)       libuvc delivered a frame
+//   convert_start(sequence, format)      conversion of a frame begins
+//   convert_end(sequence)                conversion finished
+//   strip(sequence, row)                 image_strip published from row
+//   publish(sequence, stamp_ns)          image_raw published
+//   drop(sequence, reason)               frame discarded; reason is a string
+//   control_write_start(control, value)  UVC control write begins
+//   control_write_end(control, error)    UVC control write finished
+//   stream_start(vendor, product)        streaming started
+//   stream_stop()                        streaming stopped
+
+#ifdef LIBUVC_CAMERA_USDT
+#include <sys/sdt.h>
+
+#define LIBUVC_CAMERA_TRACE0(name) DTRACE_PROBE(libuvc_camera, name)
+#define LIBUVC_CAMERA_TRACE1(name, a) DTRACE_PROBE1(libuvc_camera, name, a)
+#define LIBUVC_CAMERA_TRACE2(name, a, b) DTRACE_PROBE2(libuvc_camera, name, a, b)
+#else
+#define LIBUVC_CAMERA_TRACE0(name) do {} while (0)
+#define LIBUVC_CAMERA_TRACE1(name, a) do {} while (0)
+#define LIBUVC_CAMERA_TRACE2(name, a, b) do {} while (0)
+#endif
@@ -0,0 +1,246 @@
+#!/bin/bash
+# End-to-end bench for camera_node without camera hardware.
+#
+# Builds a UVC gadget in configfs, binds it to the dummy_hcd loopback UDC so
+# that it enumerates on the local host like a real camera, feeds it frames
+# with a userspace UVC gadget application, and runs camera_node against it
+# through the real libusb/libuvc path (iso transfers, payload headers, status
+# interrupts). Throughput and per-frame latency come from camera_node's frame
+# trace (~trace_file), decoded with trace_decode.
+#
+# usage: sudo -E uvc_gadget_bench.sh setup|teardown
+#        sudo -E uvc_gadget_bench.sh run [--baseline <summary file>]
+#
+# "run" writes its results to $OUTPUT_DIR/summary; keep one as the baseline
+# of later runs. With --baseline, or MIN_FPS / MAX_P99_MS, "run" exits with
+# status 2 when the frame rate or p99 latency regresses past them, so it can
+# gate CI. A roscore is started for the run if none is reachable.
+#
+# Requires: dummy_hcd, libcomposite and usb_f_uvc kernel modules; a UVC
+# gadget application such as uvc-gadget (git.ideasonboard.org/uvc-gadget.git)
+# that serves a pattern or frames from a file; a sourced ROS workspace.
+#
+# Environment:
+#   WIDTH, HEIGHT, FPS   stream geometry (default 640x480 @ 30)
+#   DURATION             seconds to record in "run" (default 30)
+#   OUTPUT_DIR           where trace.bin/trace.csv go (default /tmp/uvc_bench)
+#   GADGET_CMD           frame source; default "uvc-gadget uvc.0"
+#   MIN_FPS, MAX_P99_MS  absolute limits for "run" (default none)
+#   TOLERANCE            allowed regression against --baseline, in percent
+#                        (default 10)
+
+set -o errexit
+set -o nounset
+
+WIDTH=${WIDTH:-640}
+HEIGHT=${HEIGHT:-480}
+FPS=${FPS:-30}
+DURATION=${DURATION:-30}
+OUTPUT_DIR=${OUTPUT_DIR:-/tmp/uvc_bench}
+GADGET_CMD=${GADGET_CMD:-uvc-gadget uvc.0}
+MIN_FPS=${MIN_FPS:-}
+MAX_P99_MS=${MAX_P99_MS:-}
+TOLERANCE=${TOLERANCE:-10}
+
+VENDOR=0x1d6b   # Linux Foundation
+PRODUCT=0x0104  # Multifunction composite gadget
+SERIAL=uvcbench0001
+
+CONFIGFS=/sys/kernel/config/usb_gadget
+GADGET=$CONFIGFS/uvcbench
+FUNCTION=$GADGET/functions/uvc.0
+
+setup() {
+  modprobe dummy_hcd
+  modprobe libcomposite
+  modprobe usb_f_uvc
+
+  mkdir -p $GADGET
+  echo $VENDOR > $GADGET/idVendor
+  echo $PRODUCT > $GADGET/idProduct
+  mkdir -p $GADGET/strings/0x409
+  echo $SERIAL > $GADGET/strings/0x409/serialnumber
+  echo "libuvc_camera" > $GADGET/strings/0x409/manufacturer
+  echo "UVC bench" > $GADGET/strings/0x409/product
+
+  mkdir -p $GADGET/configs/c.1/strings/0x409
+  echo "UVC" > $GADGET/configs/c.1/strings/0x409/configuration
+  echo 500 > $GADGET/configs/c.1/MaxPower
+
+  mkdir -p $FUNCTION
+
+  # One uncompressed (YUYV) format with a single frame size
+  local frame=$FUNCTION/streaming/uncompressed/u/${HEIGHT}p
+  local interval=$((10000000 / FPS))
+  local frame_bytes=$((WIDTH * HEIGHT * 2))
+  mkdir -p $frame
+  echo $WIDTH > $frame/wWidth
+  echo $HEIGHT > $frame/wHeight
+  echo $frame_bytes > $frame/dwMaxVideoFrameBufferSize
+  echo $((frame_bytes * 8 * FPS)) > $frame/dwMinBitRate
+  echo $((frame_bytes * 8 * FPS)) > $frame/dwMaxBitRate
+  echo $interval > $frame/dwDefaultFrameInterval
+  echo $interval > $frame/dwFrameInterval
+
+  mkdir -p $FUNCTION/streaming/header/h
+  ln -sf $FUNCTION/streaming/uncompressed/u $FUNCTION/streaming/header/h/u
+  ln -sf $FUNCTION/streaming/header/h $FUNCTION/streaming/class/fs/h
+  ln -sf $FUNCTION/streaming/header/h $FUNCTION/streaming/class/hs/h
+  ln -sf $FUNCTION/streaming/header/h $FUNCTION/streaming/class/ss/h
+
+  mkdir -p $FUNCTION/control/header/h
+  ln -sf $FUNCTION/control/header/h $FUNCTION/control/class/fs/h
+  ln -sf $FUNCTION/control/header/h $FUNCTION/control/class/ss/h
+
+  # High-bandwidth high-speed isochronous endpoint (3 x 1024 bytes/uframe)
+  echo 3072 > $FUNCTION/streaming_maxpacket
+
+  ln -sf $FUNCTION $GADGET/configs/c.1/
+
+  # Only ever the loopback controller, never a real one
+  local udc=$(ls /sys/class/udc | grep '^dummy_udc\.' | head -n 1)
+  if [ -z "$udc" ]; then
+    echo "No dummy_udc controller; is dummy_hcd loaded?" >&2
+    exit 1
+  fi
+  echo $udc > $GADGET/UDC
+
+  echo "Gadget $VENDOR:$PRODUCT bound to $(cat $GADGET/UDC)"
+}
+
+teardown() {
+  [ -d $GADGET ] || return 0
+
+  echo "" > $GADGET/UDC || true
+  rm -f $GADGET/configs/c.1/uvc.0
+  rm -f $FUNCTION/control/class/*/h
+  rm -f $FUNCTION/streaming/class/*/h
+  rm -f $FUNCTION/streaming/header/h/u
+  rmdir $FUNCTION/control/header/h $FUNCTION/streaming/header/h || true
+  rmdir $FUNCTION/streaming/uncompressed/u/${HEIGHT}p $FUNCTION/streaming/uncompressed/u || true
+  rmdir $FUNCTION || true
+  rmdir $GADGET/configs/c.1/strings/0x409 $GADGET/configs/c.1 || true
+  rmdir $GADGET/strings/0x409 $GADGET || true
+}
+
+run() {
+  local baseline=
+  if [ "${1:-}" = "--baseline" ]; then
+    baseline=${2:?--baseline needs a summary file}
+    [ -r "$baseline" ] || { echo "Can't read baseline $baseline" >&2; exit 1; }
+  fi
+
+  mkdir -p $OUTPUT_DIR
+  rm -f $OUTPUT_DIR/trace.bin $OUTPUT_DIR/summary
+
+  local roscore_pid=
+  if ! rostopic list > /dev/null 2>&1; then
+    roscore > $OUTPUT_DIR/roscore.log 2>&1 &
+    roscore_pid=$!
+    until rostopic list > /dev/null 2>&1; do
+      kill -0 $roscore_pid 2>/dev/null || { echo "roscore failed to start" >&2; exit 1; }
+      sleep 0.5
+    done
+  fi
+
+  $GADGET_CMD > $OUTPUT_DIR/gadget.log 2>&1 &
+  local gadget_pid=$!
+
+  rosrun libuvc_camera camera_node \
+    _vendor:=$VENDOR _product:=$PRODUCT _serial:=$SERIAL \
+    _width:=$WIDTH _height:=$HEIGHT _frame_rate:=$FPS _video_mode:=yuyv \
+    _trace_file:=$OUTPUT_DIR/trace.bin \
+    > $OUTPUT_DIR/camera_node.log 2>&1 &
+  local node_pid=$!
+
+  # Only frames that reach a subscriber are converted and published.
+  timeout $DURATION rostopic hz image_raw > $OUTPUT_DIR/hz.log 2>&1 || true
+
+  kill -INT $node_pid || true
+  wait $node_pid || true
+  kill $gadget_pid || true
+  wait $gadget_pid 2>/dev/null || true
+  if [ -n "$roscore_pid" ]; then
+    kill -INT $roscore_pid || true
+    wait $roscore_pid || true
+  fi
+
+  rosrun libuvc_camera trace_decode $OUTPUT_DIR/trace.bin > $OUTPUT_DIR/trace.csv
+  summarize $OUTPUT_DIR/trace.csv $OUTPUT_DIR/summary
+  check $OUTPUT_DIR/summary "$baseline"
+}
+
+# Prints the frame rate and publish latency percentiles, and writes them as
+# fps=, p50_ms= and p99_ms= lines to the summary file. Latency is measured
+# from the USB receive time when libuvc stamps it (0.0.7 and later), else
+# from callback entry, and is labelled accordingly. Sticks to POSIX awk, as
+# mawk has no asort.
+summarize() {
+  local csv=$1 summary=$2
+  local column=4 origin=receive
+  if ! awk -F, 'NR > 1 && $4 > 0 { found = 1 } END { exit !found }' $csv; then
+    column=5 origin=callback
+    echo "No USB receive times recorded (libuvc older than 0.0.7)"
+  fi
+
+  awk -F, -v summary=$summary \
+      'NR > 1 && $8 > 0 { n++; if (n == 1) first = $5; last = $5 }
+           END {
+             if (n < 2) { print "not enough frames recorded"; exit 1 }
+             fps = (n - 1) / ((last - first) / 1e9)
+             printf "frames: %d  rate: %.2f fps\n", n, fps
+             printf "fps=%.2f\n", fps > summary
+           }' $csv
+
+  awk -F, -v c=$column 'NR > 1 && $8 > 0 && $c > 0 { print ($8 - $c) / 1e6 }' $csv |
+    sort -n |
+    awk -v origin=$origin -v summary=$summary '{ lat[NR] = $1 }
+           END {
+             printf "%s -> publish latency ms  p50: %.2f  p99: %.2f  max: %.2f\n",
+                    origin, lat[int(NR * 0.5) + 1], lat[int(NR * 0.99) + 1], lat[NR]
+             printf "p50_ms=%.2f\np99_ms=%.2f\n", lat[int(NR * 0.5) + 1],
+                    lat[int(NR * 0.99) + 1] >> summary
+           }'
+}
+
+# Value of key in a summary file
+summary_value() {
+  sed -n "s/^$2=//p" $1
+}
+
+# Fails (status 2) if the summary's frame rate is below MIN_FPS or the
+# baseline's less TOLERANCE percent, or its p99 latency is above MAX_P99_MS
+# or the baseline's plus TOLERANCE percent.
+check() {
+  local summary=$1 baseline=$2
+  local fps=$(summary_value $summary fps) p99=$(summary_value $summary p99_ms)
+  local min_fps=$MIN_FPS max_p99=$MAX_P99_MS
+
+  if [ -n "$baseline" ]; then
+    min_fps=$(awk -v a=$(summary_value $baseline fps) -v b="$min_fps" -v t=$TOLERANCE \
+      'BEGIN { v = a * (1 - t / 100); if (b != "" && b > v) v = b; printf "%.2f", v }')
+    max_p99=$(awk -v a=$(summary_value $baseline p99_ms) -v b="$max_p99" -v t=$TOLERANCE \
+      'BEGIN { v = a * (1 + t / 100); if (b != "" && b < v) v = b; printf "%.2f", v }')
+  fi
+
+  local failed=0
+  if [ -n "$min_fps" ] && awk -v v=$fps -v l=$min_fps 'BEGIN { exit !(v < l) }'; then
+    echo "REGRESSION: $fps fps is below $min_fps" >&2
+    failed=1
+  fi
+  if [ -n "$max_p99" ] && awk -v v=$p99 -v l=$max_p99 'BEGIN { exit !(v > l) }'; then
+    echo "REGRESSION: p99 latency $p99 ms is above $max_p99 ms" >&2
+    failed=1
+  fi
+  [ $failed -eq 0 ] || exit 2
+}
+
+case "${1:-}" in
+  setup) setup ;;
+  run) shift; run "$@" ;;
+  teardown) teardown ;;
+  *)
+    echo "usage: $0 setup|run [--baseline <summary file>]|teardown" >&2
+    exit 1
+    ;;
+esac
@@ -0,0 +1,166 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/bag_writer.h"
+
+#include <stdio.h>
+#include <sstream>
+
+namespace libuvc_camera {
+
+BagWriter::BagWriter()
+  : open_(false), stop_(false), drops_(0), bag_open_(false), split_index_(0) {
+}
+
+BagWriter::~BagWriter() {
+  Close();
+}
+
+bool BagWriter::ParseCompression(const std::string &name,
+                                 rosbag::compression::CompressionType *compression) {
+  if (name == "none")
+    *compression = rosbag::compression::Uncompressed;
+  else if (name == "bz2")
+    *compression = rosbag::compression::BZ2;
+  else if (name == "lz4")
+    *compression = rosbag::compression::LZ4;
+  else
+    return false;
+  return true;
+}
+
+bool BagWriter::Open(const Options &options) {
+  Close();
+
+  options_ = options;
+  if (options_.path.size() > 4 &&
+      options_.path.compare(options_.path.size() - 4, 4, ".bag") == 0)
+    options_.path.resize(options_.path.size() - 4);
+
+  split_index_ = 0;
+  split_paths_.clear();
+  if (!OpenBag())
+    return false;
+
+  open_ = true;
+  stop_ = false;
+  drops_ = 0;
+  writer_ = boost::thread(&BagWriter::WriterLoop, this);
+  return true;
+}
+
+void BagWriter::Close() {
+  if (!open_)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+  queue_cond_.notify_all();
+  writer_.join();
+
+  CloseBag();
+  open_ = false;
+
+  if (drops_)
+    ROS_WARN("Bag writer dropped %lu messages", drops_);
+}
+
+void BagWriter::Enqueue(const Task &task) {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if ((int) queue_.size() >= options_.queue_size) {
+      ++drops_;
+      ROS_WARN_THROTTLE(10, "Bag writer can't keep up, dropped %lu messages so far", drops_);
+      return;
+    }
+    queue_.push_back(task);
+  }
+  queue_cond_.notify_one();
+}
+
+void BagWriter::WriterLoop() {
+  for (;;) {
+    Task task;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (queue_.empty() && !stop_)
+        queue_cond_.wait(lock);
+      if (queue_.empty())
+        break;
+      task = queue_.front();
+      queue_.pop_front();
+    }
+
+    try {
+      task();
+    } catch (rosbag::BagException &e) {
+      ROS_WARN_THROTTLE(10, "Bag write failed: %s", e.what());
+    }
+  }
+}
+
+bool BagWriter::OpenBag() {
+  std::ostringstream path;
+  path << options_.path;
+  if (options_.split_bytes)
+    path << "_" << split_index_++;
+  path << ".bag";
+
+  try {
+    bag_.open(path.str(), rosbag::bagmode::Write);
+    bag_.setCompression(options_.compression);
+  } catch (rosbag::BagException &e) {
+    ROS_WARN("Can't open bag %s: %s", path.str().c_str(), e.what());
+    return false;
+  }
+  bag_open_ = true;
+
+  split_paths_.push_back(path.str());
+  while (options_.max_splits > 0 && (int) split_paths_.size() > options_.max_splits) {
+    remove(split_paths_.front().c_str());
+    split_paths_.pop_front();
+  }
+
+  ROS_INFO("Recording to bag %s", path.str().c_str());
+  return true;
+}
+
+void BagWriter::CloseBag() {
+  if (bag_open_)
+    bag_.close();
+  bag_open_ = false;
+}
+
+};
@@ -32,34 +32,232 @@
 *  POSSIBILITY OF SUCH DAMAGE.
 *********************************************************************/
 #include "libuvc_camera/camera_driver.h"
+#include "libuvc_camera/conversion_planner.h"
+#include "libuvc_camera/image_pyramid.h"
+#include "libuvc_camera/tracepoints.h"
 
 #include <ros/ros.h>
 #include <sensor_msgs/Image.h>
+#include <sensor_msgs/image_encodings.h>
 #include <std_msgs/Header.h>
 #include <image_transport/camera_publisher.h>
 #include <dynamic_reconfigure/server.h>
 #include <libuvc/libuvc.h>
+#include <algorithm>
+#include <sstream>
+#include <stdlib.h>
 
 namespace libuvc_camera {
 
-CameraDriver::CameraDriver(ros::NodeHandle nh, ros::NodeHandle priv_nh)
+namespace {
+
+// Opening and closing devices edits the context's device list, which libuvc
+// does not lock; drivers sharing a context serialize those calls here.
+boost::mutex ctx_devices_mutex;
+
+// Rows converted and color-corrected at a time when the software ISP is on;
+// small enough for a 1080p bgra8 band to stay in L2.
+const int kIspBandRows = 16;
+
+// Handle in the public namespace whose callbacks (set_camera_info) are served
+// from the private handle's queue, alongside the other control services.
+ros::NodeHandle ControlNodeHandle(const ros::NodeHandle &nh,
+                                  const ros::NodeHandle &priv_nh) {
+  ros::NodeHandle control_nh(nh);
+  control_nh.setCallbackQueue(priv_nh.getCallbackQueue());
+  return control_nh;
+}
+
+// Copies packed rows of row_bytes into an image with a possibly padded step,
+// stopping at whichever of src_bytes and the image ends first.
+void CopyRows(const void *src, size_t src_bytes, size_t row_bytes,
+              sensor_msgs::Image *image) {
+  size_t rows = std::min(src_bytes / row_bytes, (size_t) image->height);
+  if (image->step == row_bytes) {
+    memcpy(&(image->data[0]), src, rows * row_bytes);
+    return;
+  }
+
+  const uint8_t *src_row = static_cast<const uint8_t*>(src);
+  for (size_t row = 0; row < rows; ++row, src_row += row_bytes)
+    memcpy(&(image->data[0]) + row * image->step, src_row, row_bytes);
+}
+
+}
+
+CameraDriver::CameraDriver(ros::NodeHandle nh, ros::NodeHandle priv_nh,
+                           bool use_decode_pool)
   : nh_(nh), priv_nh_(priv_nh),
     state_(kInitial),
-    ctx_(NULL), dev_(NULL), devh_(NULL), rgb_frame_(NULL),
+    ctx_(NULL), owns_ctx_(true), dev_(NULL), devh_(NULL), rgb_frame_(NULL),
+    yuyv_kernel_(kYuyvKernelUvc),
+    yuyv_bgra_kernel_(kYuyvKernelScalar),
+    decode_queue_drops_(0),
+    use_huge_pages_(false), raw_frame_bytes_(0),
+    stale_convert_drops_(0), stale_publish_drops_(0),
     it_(nh_),
+    row_alignment_(1),
+    strip_rows_(0),
+    frame_period_(0.0),
+    h264_had_subscribers_(false),
     creation_(true),
     config_changed_(false),
-    cinfo_manager_(nh) {
-  config_server_ = new dynamic_reconfigure::Server<UVCCameraConfig>(mutex_, priv_nh_);
+    cinfo_manager_(ControlNodeHandle(nh, priv_nh)) {
+  config_server_.reset(new dynamic_reconfigure::Server<UVCCameraConfig>(mutex_, priv_nh_));
   config_server_->setCallback(boost::bind(&CameraDriver::ReconfigureCallback, this, _1, _2));
   cam_pub_ = it_.advertiseCamera("image_raw", 1, false);
+
+  // Spacing between rows, not the address of the buffer; more than a cache
+  // line buys nothing but padding.
+  priv_nh_.param("row_alignment", row_alignment_, 1);
+  if (row_alignment_ < 1 || row_alignment_ > 64 || (row_alignment_ & (row_alignment_ - 1))) {
+    ROS_WARN("row_alignment must be a power of two up to 64, not %d; using packed rows",
+             row_alignment_);
+    row_alignment_ = 1;
+  }
+
+  priv_nh_.param("strip_rows", strip_rows_, 0);
+  if (strip_rows_ > 0)
+    strip_pub_ = nh_.advertise<ImageStrip>("image_raw/strips", 16);
+  frame_start_pub_ = nh_.advertise<FrameStart>("image_raw/frame_start", 1);
+
+  int pyramid_levels;
+  priv_nh_.param("pyramid_levels", pyramid_levels, 0);
+  for (int level = 1; level <= pyramid_levels; ++level) {
+    std::ostringstream topic;
+    topic << "image_raw/level" << level;
+    pyramid_pubs_.push_back(it_.advertise(topic.str(), 1));
+  }
+
+  priv_nh_.param("use_decode_pool", use_decode_pool, use_decode_pool);
+  if (use_decode_pool) {
+    int decode_threads, decode_priority, decode_queue_depth;
+    priv_nh_.param("decode_threads", decode_threads, 0);
+    priv_nh_.param("decode_priority", decode_priority, 1);
+    priv_nh_.param("decode_queue_depth", decode_queue_depth, 2);
+
+    DecodePool &pool = DecodePool::Instance(decode_threads);
+    decode_strand_ = pool.CreateStrand(decode_priority);
+    for (int i = 0; i < std::max(decode_queue_depth, 1); ++i)
+      raw_frames_.push_back(uvc_allocate_frame(0));
+    free_raw_frames_ = raw_frames_;
+
+    ROS_INFO("Decoding on shared pool of %d threads with priority %d",
+             pool.NumThreads(), decode_priority);
+  }
+
+  std::string trace_file;
+  priv_nh_.param("trace_file", trace_file, std::string());
+  if (!trace_file.empty()) {
+    int trace_records;
+    priv_nh_.param("trace_records", trace_records, 65536);
+    if (tracer_.Open(trace_file, std::max(trace_records, 1)))
+      ROS_INFO("Tracing frames to %s (%d records)", trace_file.c_str(), trace_records);
+  }
+
+  priv_nh_.param("payload_capture_file", payload_capture_file_, std::string());
+
+  priv_nh_.param("huge_pages", use_huge_pages_, false);
+
+  if (priv_nh_.getParam("isp_color_matrix", isp_color_matrix_) &&
+      isp_color_matrix_.size() != 9) {
+    ROS_WARN("isp_color_matrix needs 9 values (row-major 3x3), not %lu; using identity",
+             (unsigned long) isp_color_matrix_.size());
+    isp_color_matrix_.clear();
+  }
+
+  image_topic_ = nh_.resolveName("image_raw");
+  camera_info_topic_ = nh_.resolveName("camera_info");
+
+  BagWriter::Options bag_options;
+  priv_nh_.param("bag_file", bag_options.path, std::string());
+  if (!bag_options.path.empty()) {
+    double bag_split_size;
+    std::string bag_compression;
+    std::vector<std::string> bag_outputs;
+    priv_nh_.param("bag_split_size", bag_split_size, 0.0);  // MB
+    priv_nh_.param("bag_max_splits", bag_options.max_splits, 0);
+    priv_nh_.param("bag_compression", bag_compression, std::string("none"));
+    priv_nh_.param("bag_queue_size", bag_options.queue_size, 8);
+    if (!priv_nh_.getParam("bag_outputs", bag_outputs)) {
+      bag_outputs.push_back("image_raw");
+      bag_outputs.push_back("camera_info");
+    }
+
+    bag_options.split_bytes = (uint64_t) (std::max(bag_split_size, 0.0) * 1024 * 1024);
+    bag_options.outputs.insert(bag_outputs.begin(), bag_outputs.end());
+    if (!BagWriter::ParseCompression(bag_compression, &bag_options.compression)) {
+      ROS_WARN("Unknown bag_compression %s; use none, bz2 or lz4", bag_compression.c_str());
+      bag_options.compression = rosbag::compression::Uncompressed;
+    }
+
+    bag_writer_.Open(bag_options);
+  }
+
+  bool use_h264;
+  priv_nh_.param("h264", use_h264, false);
+  if (use_h264) {
+    H264Encoder::Options h264_options;
+    priv_nh_.param("h264_bitrate", h264_options.bitrate_kbps, 2000);
+    priv_nh_.param("h264_keyframe_interval", h264_options.keyframe_interval, 30);
+    priv_nh_.param("h264_threads", h264_options.threads, 1);
+
+    h264_topic_ = nh_.resolveName("image_raw/h264");
+    h264_pub_ = nh_.advertise<sensor_msgs::CompressedImage>("image_raw/h264", 4);
+    h264_encoder_.Start(h264_options, boost::bind(&CameraDriver::PublishH264, this, _1));
+  }
+
+  bool use_jpeg;
+  priv_nh_.param("jpeg", use_jpeg, false);
+  if (use_jpeg) {
+    int jpeg_quality;
+    priv_nh_.param("jpeg_quality", jpeg_quality, 80);
+
+    // Named like an image_transport compressed topic, so image_transport
+    // subscribers can use image_jpeg with the compressed transport.
+    jpeg_topic_ = nh_.resolveName("image_jpeg/compressed");
+    jpeg_pub_ = nh_.advertise<sensor_msgs::CompressedImage>("image_jpeg/compressed", 4);
+    jpeg_encoder_.Start(jpeg_quality, boost::bind(&CameraDriver::PublishJpeg, this, _1));
+  }
+
+  std::string record_file;
+  priv_nh_.param("record_file", record_file, std::string());
+  if (!record_file.empty()) {
+    std::string record_codec;
+    int record_level, record_threads, record_queue_depth;
+    priv_nh_.param("record_codec", record_codec, std::string("lz4"));
+    priv_nh_.param("record_level", record_level, 1);
+    priv_nh_.param("record_threads", record_threads, 2);
+    priv_nh_.param("record_queue_depth", record_queue_depth, 4);
+
+    FrameRecordingCodec codec;
+    if (!FrameRecorder::ParseCodec(record_codec, &codec))
+      ROS_WARN("Unknown record_codec %s; use lz4 or zstd", record_codec.c_str());
+    else if (recorder_.Open(record_file, codec, record_level, record_threads, record_queue_depth))
+      ROS_INFO("Recording frames to %s with %s on %d threads",
+               record_file.c_str(), record_codec.c_str(), record_threads);
+  }
+
+  priv_nh_.param("conversion_kernel", conversion_kernel_, std::string("auto"));
+  priv_nh_.param("conversion_plan_cache", conversion_plan_cache_, DefaultPlanCachePath());
 }
 
 CameraDriver::~CameraDriver() {
+  // Unregisters the reconfigure service, waiting out a call in progress,
+  // while this driver and mutex_ are still whole.
+  config_server_.reset();
+
+  // Their threads publish through this driver.
+  h264_encoder_.Stop();
+  jpeg_encoder_.Stop();
+
   if (rgb_frame_)
     uvc_free_frame(rgb_frame_);
 
-  if (ctx_)
+  for (size_t i = 0; i < raw_frames_.size(); ++i)
+    uvc_free_frame(raw_frames_[i]);
+
+  if (ctx_ && owns_ctx_)
     uvc_exit(ctx_);  // Destroys dev_, devh_, etc.
 }
 
@@ -76,6 +274,7 @@ bool CameraDriver::Start() {
     return false;
   }
 
+  owns_ctx_ = true;
   state_ = kStopped;
   
   creation_ = false;
@@ -84,8 +283,44 @@ bool CameraDriver::Start() {
   return state_ == kRunning;
 }
 
+bool CameraDriver::Start(uvc_context_t *shared_ctx) {
+  assert(state_ == kInitial);
+  assert(shared_ctx);
+
+  ctx_ = shared_ctx;
+  owns_ctx_ = false;
+  state_ = kStopped;
+
+  creation_ = false;
+  ReconfigureCallback(config_, 0);
+
+  return state_ == kRunning;
+}
+
+void CameraDriver::StartReplay(int width, int height) {
+  assert(state_ == kInitial);
+
+  {
+    boost::mutex::scoped_lock lock(config_mutex_);
+    config_.width = width;
+    config_.height = height;
+  }
+
+  AllocateFrameBuffers(width, height, (size_t) width * height * 4);
+
+  SelectYuyvKernel(width, height);
+
+  state_ = kReplaying;
+}
+
+void CameraDriver::ReplayFrame(uvc_frame_t *frame) {
+  assert(state_ == kReplaying);
+
+  ImageCallback(frame);
+}
+
 void CameraDriver::Stop() {
-  boost::recursive_mutex::scoped_lock(mutex_);
+  boost::recursive_mutex::scoped_lock lock(mutex_);
 
   assert(state_ != kInitial);
 
@@ -94,20 +329,31 @@ void CameraDriver::Stop() {
 
   assert(state_ == kStopped);
 
-  uvc_exit(ctx_);
+  if (owns_ctx_)
+    uvc_exit(ctx_);
   ctx_ = NULL;
 
   state_ = kInitial;
 }
 
 void CameraDriver::ReconfigureCallback(UVCCameraConfig &new_config, uint32_t level) {
+  // Frames go stale in the encoders' and the recorder's queues as well, so
+  // they apply the deadline when they dequeue a frame.
+  h264_encoder_.SetMaxFrameAge(new_config.max_frame_age);
+  jpeg_encoder_.SetMaxFrameAge(new_config.max_frame_age);
+  recorder_.SetMaxFrameAge(new_config.max_frame_age);
+
   if (creation_)
   {
     ROS_DEBUG("Setting config");
+    boost::mutex::scoped_lock lock(config_mutex_);
     config_ = new_config;
     return;
   }
-  boost::recursive_mutex::scoped_lock(mutex_);
+  // The server calls us with mutex_ held already; this makes it explicit.
+  boost::recursive_mutex::scoped_lock lock(mutex_);
+  // AutoControlsCallback may update config_ while the controls are written
+  const UVCCameraConfig old_config = ConfigSnapshot();
 
   if ((level & kReconfigureClose) == kReconfigureClose) {
     if (state_ == kRunning)
@@ -118,15 +364,18 @@ void CameraDriver::ReconfigureCallback(UVCCameraConfig &new_config, uint32_t lev
     OpenCamera(new_config);
   }
 
-  if (new_config.camera_info_url != config_.camera_info_url)
+  if (new_config.camera_info_url != old_config.camera_info_url)
     cinfo_manager_.loadCameraInfo(new_config.camera_info_url);
 
   if (state_ == kRunning) {
-#define PARAM_INT(name, fn, value) if (new_config.name != config_.name) { \
+#define PARAM_INT(name, fn, value) if (new_config.name != old_config.name) { \
       int val = (value);                                                \
-      if (uvc_set_##fn(devh_, val)) {                                   \
+      LIBUVC_CAMERA_TRACE2(control_write_start, #name, val);            \
+      uvc_error_t set_err = uvc_set_##fn(devh_, val);                   \
+      LIBUVC_CAMERA_TRACE2(control_write_end, #name, set_err);          \
+      if (set_err) {                                                    \
         ROS_WARN("Unable to set " #name " to %d", val);                 \
-        new_config.name = config_.name;                                 \
+        new_config.name = old_config.name;                                 \
       }                                                                 \
       else {                                                            \
         ROS_INFO("Set " #name " to %d", val);                           \
@@ -144,11 +393,14 @@ void CameraDriver::ReconfigureCallback(UVCCameraConfig &new_config, uint32_t lev
     PARAM_INT(brightness, brightness, new_config.brightness);
     
 
-    if (new_config.pan_absolute != config_.pan_absolute || new_config.tilt_absolute != config_.tilt_absolute) {
-      if (uvc_set_pantilt_abs(devh_, new_config.pan_absolute, new_config.tilt_absolute)) {
+    if (new_config.pan_absolute != old_config.pan_absolute || new_config.tilt_absolute != old_config.tilt_absolute) {
+      LIBUVC_CAMERA_TRACE2(control_write_start, "pantilt", new_config.pan_absolute);
+      uvc_error_t set_err = uvc_set_pantilt_abs(devh_, new_config.pan_absolute, new_config.tilt_absolute);
+      LIBUVC_CAMERA_TRACE2(control_write_end, "pantilt", set_err);
+      if (set_err) {
         ROS_WARN("Unable to set pantilt to %d, %d", new_config.pan_absolute, new_config.tilt_absolute);
-        new_config.pan_absolute = config_.pan_absolute;
-        new_config.tilt_absolute = config_.tilt_absolute;
+        new_config.pan_absolute = old_config.pan_absolute;
+        new_config.tilt_absolute = old_config.tilt_absolute;
       }
     }
     // TODO: roll_absolute
@@ -164,6 +416,7 @@ void CameraDriver::ReconfigureCallback(UVCCameraConfig &new_config, uint32_t lev
     // TODO: white_balance_temperature
     // TODO: white_balance_BU
     // TODO: white_balance_RV
+    boost::mutex::scoped_lock config_lock(config_mutex_);
     config_ = new_config;
   }
 }
@@ -172,64 +425,500 @@ void CameraDriver::ImageCallback(uvc_frame_t *frame) {
   // TODO: Switch to {frame}'s timestamp once that becomes reliable.
   ros::Time timestamp = ros::Time::now();
 
-  boost::recursive_mutex::scoped_lock(mutex_);
+  LIBUVC_CAMERA_TRACE2(frame_arrival, frame->sequence, frame->data_bytes);
 
   if (frame->data == NULL)
   {
     ROS_WARN("Got NULL");
+    LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "null_frame");
     return;
   }
 
-  assert(state_ == kRunning);
+  const UVCCameraConfig config = ConfigSnapshot();
+  PublishFrameStart(config, frame, timestamp);
+
+  // Older libuvc leaves frame->capture_time unset, so there is no receive
+  // time to record without capture_time_finished.
+  uint64_t usb_receive_ns = 0;
+#ifdef LIBUVC_CAMERA_HAVE_CAPTURE_TIME_FINISHED
+  usb_receive_ns = (uint64_t) frame->capture_time_finished.tv_sec * 1000000000ull +
+    (uint64_t) frame->capture_time_finished.tv_nsec;
+#endif
+  FrameTraceRecord *trace = tracer_.Begin(frame->sequence, frame->data_bytes, usb_receive_ns);
+
+  if (payload_capture_.IsRunning())
+    payload_capture_.SetFormat(frame->frame_format, frame->width, frame->height);
+
+  if (recorder_.IsOpen() && frame->frame_format != UVC_FRAME_FORMAT_MJPEG)
+    recorder_.Submit(frame, timestamp.toNSec());
+
+  if (h264_encoder_.IsRunning() && H264Encoder::CanEncode(frame->frame_format)) {
+    bool wanted = h264_pub_.getNumSubscribers() > 0 || bag_writer_.Wants("image_raw/h264");
+    // Start every new viewer on a keyframe.
+    if (wanted)
+      h264_encoder_.Submit(frame, config.frame_id, timestamp, config.frame_rate,
+                           !h264_had_subscribers_);
+    h264_had_subscribers_ = wanted;
+  }
+
+  if (jpeg_encoder_.IsRunning() && JpegEncoder::CanEncode(frame->frame_format) &&
+      (jpeg_pub_.getNumSubscribers() > 0 || bag_writer_.Wants("image_jpeg/compressed")))
+    jpeg_encoder_.Submit(frame, config.frame_id, timestamp);
+
+  if (!decode_strand_) {
+    ProcessFrame(frame, timestamp, trace);
+    tracer_.Commit(trace);
+    return;
+  }
+
+  // libuvc reuses the frame's buffer once we return, so queue a copy.
+  uvc_frame_t *copy = NULL;
+  {
+    boost::mutex::scoped_lock lock(raw_frames_mutex_);
+    if (!free_raw_frames_.empty()) {
+      copy = free_raw_frames_.back();
+      free_raw_frames_.pop_back();
+    }
+  }
+
+  if (!copy) {
+    ++decode_queue_drops_;
+    ROS_WARN_THROTTLE(10, "Decode queue full, dropped %lu frames so far", decode_queue_drops_);
+    LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "decode_queue_full");
+    tracer_.Commit(trace);
+    return;
+  }
+
+  // Arena-backed copies report their slot's capacity to uvc_duplicate_frame,
+  // which then leaves data_bytes alone.
+  if (!copy->library_owns_data)
+    copy->data_bytes = raw_frame_bytes_;
+  uvc_error_t dup_ret = uvc_duplicate_frame(frame, copy);
+  copy->data_bytes = frame->data_bytes;
+  if (dup_ret != UVC_SUCCESS) {
+    ROS_WARN("Couldn't copy frame for decoding: %s", uvc_strerror(dup_ret));
+    LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "copy_failed");
+    tracer_.Commit(trace);
+    boost::mutex::scoped_lock lock(raw_frames_mutex_);
+    free_raw_frames_.push_back(copy);
+    return;
+  }
+
+  DecodePool::Instance().Submit(
+    decode_strand_, boost::bind(&CameraDriver::DecodeTask, this, copy, timestamp, trace));
+}
+
+void CameraDriver::PublishH264(const sensor_msgs::CompressedImage::Ptr &packet) {
+  h264_pub_.publish(packet);
+  bag_writer_.Write("image_raw/h264", h264_topic_, packet->header.stamp, packet);
+}
+
+void CameraDriver::PublishJpeg(const sensor_msgs::CompressedImage::Ptr &packet) {
+  jpeg_pub_.publish(packet);
+  bag_writer_.Write("image_jpeg/compressed", jpeg_topic_, packet->header.stamp, packet);
+}
+
+void CameraDriver::PublishFrameStart(const UVCCameraConfig &config, uvc_frame_t *frame,
+                                     ros::Time timestamp) {
+  if (!last_frame_time_.isZero()) {
+    double interval = (timestamp - last_frame_time_).toSec();
+    frame_period_ = frame_period_ > 0.0 ? 0.9 * frame_period_ + 0.1 * interval : interval;
+  }
+  last_frame_time_ = timestamp;
+
+  if (frame_start_pub_.getNumSubscribers() == 0)
+    return;
+
+  double period = frame_period_;
+  if (period <= 0.0 && config.frame_rate > 0)
+    period = 1.0 / config.frame_rate;
+
+  // libuvc completes a frame when the next one's first payload toggles FID
+  // (or on EOF just before it), so the next frame is already on its way.
+  FrameStart::Ptr start(new FrameStart());
+  start->header.frame_id = config.frame_id;
+  start->header.stamp = timestamp + ros::Duration(period);
+  start->sequence = frame->sequence + 1;
+  frame_start_pub_.publish(start);
+}
+
+void CameraDriver::DecodeTask(uvc_frame_t *frame, ros::Time timestamp,
+                              FrameTraceRecord *trace) {
+  ProcessFrame(frame, timestamp, trace);
+  tracer_.Commit(trace);
+
+  boost::mutex::scoped_lock lock(raw_frames_mutex_);
+  free_raw_frames_.push_back(frame);
+}
+
+std::string CameraDriver::OutputEncoding(const UVCCameraConfig &config,
+                                         enum uvc_frame_format format) {
+  // 4-byte pixels are produced by every conversion but the yuv422 passthrough.
+  if (config.output_encoding == "bgra8" || config.output_encoding == "rgba8")
+    return format == UVC_FRAME_FORMAT_UYVY ? "yuv422" : config.output_encoding;
+
+  if (config.output_encoding == "mono8") {
+    // Packed 4:2:2 carries its luma in every other byte.
+    if (format == UVC_FRAME_FORMAT_YUYV || format == UVC_FRAME_FORMAT_UYVY)
+      return "mono8";
+    if (format != UVC_FRAME_FORMAT_MJPEG)
+      ROS_WARN_ONCE("mono8 output needs MJPEG, YUYV or UYVY frames; publishing color");
+  }
+
+  switch (format) {
+  case UVC_FRAME_FORMAT_UYVY:
+    return "yuv422";
+  case UVC_FRAME_FORMAT_RGB:
+    return "rgb8";
+  case UVC_FRAME_FORMAT_MJPEG:
+    if (config.output_encoding == "yuv422" || config.output_encoding == "mono8") {
+      if (MjpegDecoder::Supported())
+        return config.output_encoding;
+      ROS_WARN_ONCE("Built without libjpeg; publishing MJPEG as rgb8");
+    }
+    return "rgb8";
+  default:
+    return "bgr8";
+  }
+}
+
+bool CameraDriver::ConfigureIsp(const UVCCameraConfig &config, const std::string &encoding) {
+  if (!config.isp)
+    return false;
+  if (sensor_msgs::image_encodings::numChannels(encoding) < 3) {
+    ROS_WARN_ONCE("Software ISP only corrects color images, not %s", encoding.c_str());
+    return false;
+  }
+
+  SoftwareIsp::Options options;
+  options.gains[0] = config.isp_gain_red;
+  options.gains[1] = config.isp_gain_green;
+  options.gains[2] = config.isp_gain_blue;
+  if (!isp_color_matrix_.empty())
+    std::copy(isp_color_matrix_.begin(), isp_color_matrix_.end(), options.matrix);
+  options.gamma = config.isp_gamma;
+  software_isp_.Configure(options);
+  return true;
+}
+
+void CameraDriver::CorrectRows(sensor_msgs::Image *image, int row, int rows) {
+  software_isp_.Apply(&(image->data[0]) + row * image->step, image->step, image->width, rows,
+                      sensor_msgs::image_encodings::numChannels(image->encoding),
+                      image->encoding == "rgb8" || image->encoding == "rgba8");
+}
+
+void CameraDriver::PublishPyramid(const sensor_msgs::Image &image) {
+  // Levels below the deepest subscribed one have to be computed anyway.
+  int levels = 0;
+  for (int level = 1; level <= (int) pyramid_pubs_.size(); ++level) {
+    if (pyramid_pubs_[level - 1].getNumSubscribers() > 0)
+      levels = level;
+  }
+  if (levels == 0)
+    return;
+
+  if (sensor_msgs::image_encodings::bitDepth(image.encoding) != 8 || image.encoding == "yuv422") {
+    ROS_WARN_ONCE("Can't build an image pyramid from %s images", image.encoding.c_str());
+    return;
+  }
+  int channels = sensor_msgs::image_encodings::numChannels(image.encoding);
+
+  // Each level is reduced from the previous one while that is still in cache.
+  const sensor_msgs::Image *previous = &image;
+  sensor_msgs::Image::Ptr previous_level;
+  for (int level = 1; level <= levels && previous->width >= 2 && previous->height >= 2; ++level) {
+    sensor_msgs::Image::Ptr reduced(new sensor_msgs::Image());
+    reduced->header = image.header;
+    reduced->encoding = image.encoding;
+    reduced->is_bigendian = image.is_bigendian;
+    reduced->width = previous->width / 2;
+    reduced->height = previous->height / 2;
+    reduced->step = (reduced->width * channels + row_alignment_ - 1) &
+      ~(size_t) (row_alignment_ - 1);
+    reduced->data.resize(reduced->step * reduced->height);
+
+    HalveImage(&(previous->data[0]), previous->step, previous->width, previous->height,
+               channels, &(reduced->data[0]), reduced->step);
+
+    if (pyramid_pubs_[level - 1].getNumSubscribers() > 0)
+      pyramid_pubs_[level - 1].publish(reduced);
+    previous_level = reduced;
+    previous = reduced.get();
+  }
+}
+
+int CameraDriver::StripRows() {
+  if (strip_rows_ <= 0 || strip_pub_.getNumSubscribers() == 0)
+    return 0;
+  return strip_rows_;
+}
+
+void CameraDriver::PublishStrip(const sensor_msgs::Image &image, int row, int rows,
+                                uint32_t sequence, FrameTraceRecord *trace) {
+  ImageStrip::Ptr strip(new ImageStrip());
+  strip->row_offset = row;
+  strip->frame_height = image.height;
+  strip->image.header = image.header;
+  strip->image.width = image.width;
+  strip->image.height = rows;
+  strip->image.encoding = image.encoding;
+  strip->image.is_bigendian = image.is_bigendian;
+  strip->image.step = image.step;
+  strip->image.data.assign(image.data.begin() + (size_t) row * image.step,
+                           image.data.begin() + (size_t) (row + rows) * image.step);
+  strip_pub_.publish(strip);
+  LIBUVC_CAMERA_TRACE2(strip, sequence, row);
+  if (trace && row == 0)
+    trace->first_strip_ns = FrameTracer::Now();
+}
+
+bool CameraDriver::HasMotion(const UVCCameraConfig &config, uvc_frame_t *frame,
+                             ros::Time timestamp, bool *sampled) {
+  *sampled = false;
+  if (config.motion_threshold <= 0.0)
+    return true;
+
+  const uint8_t *data = static_cast<uint8_t*>(frame->data);
+  size_t pixels = (size_t) frame->width * frame->height;
+
+  // Sample luma straight from the raw frame, before any conversion. RGB
+  // formats use green as a stand-in.
+  if ((frame->frame_format == UVC_FRAME_FORMAT_YUYV ||
+       frame->frame_format == UVC_FRAME_FORMAT_UYVY) && frame->data_bytes >= pixels * 2) {
+    motion_detector_.Sample(data + (frame->frame_format == UVC_FRAME_FORMAT_UYVY), 2,
+                            frame->width * 2, frame->width, frame->height);
+  } else if (frame->frame_format == UVC_FRAME_FORMAT_GRAY8 && frame->data_bytes >= pixels) {
+    motion_detector_.Sample(data, 1, frame->width, frame->width, frame->height);
+  } else if ((frame->frame_format == UVC_FRAME_FORMAT_BGR ||
+              frame->frame_format == UVC_FRAME_FORMAT_RGB) && frame->data_bytes >= pixels * 3) {
+    motion_detector_.Sample(data + 1, 3, frame->width * 3, frame->width, frame->height);
+  } else if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
+    // At 1/8 scale libjpeg only evaluates each block's DC coefficient.
+    int width, height;
+    if (!mjpeg_decoder_.DecodeLumaThumbnail(data, frame->data_bytes, &motion_thumbnail_,
+                                            &width, &height) || width == 0 || height == 0)
+      return true;
+    motion_detector_.Sample(&motion_thumbnail_[0], 1, width, width, height);
+  } else {
+    return true;
+  }
+
+  // The reference only moves once the frame is actually published, so a
+  // frame dropped later doesn't hide its change or reset the keep-alive.
+  *sampled = true;
+  double difference = motion_detector_.Difference();
+  return difference < 0.0 || difference >= config.motion_threshold ||
+    (timestamp - last_motion_publish_).toSec() >= config.motion_keepalive;
+}
+
+UVCCameraConfig CameraDriver::ConfigSnapshot() {
+  boost::mutex::scoped_lock lock(config_mutex_);
+  return config_;
+}
+
+bool CameraDriver::IsStale(const UVCCameraConfig &config, ros::Time timestamp,
+                           unsigned long *drop_counter) {
+  if (config.max_frame_age <= 0.0)
+    return false;
+
+  if ((ros::Time::now() - timestamp).toSec() <= config.max_frame_age)
+    return false;
+
+  ++*drop_counter;
+  ROS_WARN_THROTTLE(10, "Dropped stale frames: %lu before conversion, %lu before publishing",
+                    stale_convert_drops_, stale_publish_drops_);
+  return true;
+}
+
+void CameraDriver::ProcessFrame(uvc_frame_t *frame, ros::Time timestamp,
+                                FrameTraceRecord *trace) {
+  // Not mutex_: CloseCamera runs under it and waits for this thread to
+  // finish its frame. Work from a consistent copy of the config instead.
+  const UVCCameraConfig config = ConfigSnapshot();
+
+  // timestamp is taken on entry to ImageCallback, so this only fires for
+  // frames that waited in the decode pool's queue; inline, conversion starts
+  // right away.
+  if (IsStale(config, timestamp, &stale_convert_drops_)) {
+    LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "stale_before_convert");
+    return;
+  }
+
+  assert(state_ == kRunning || state_ == kReplaying);
   assert(rgb_frame_);
 
+  bool motion_sampled;
+  if (!HasMotion(config, frame, timestamp, &motion_sampled)) {
+    LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "no_motion");
+    return;
+  }
+
   sensor_msgs::Image::Ptr image(new sensor_msgs::Image());
 
-  if (config_.width == 0 || config_.height == 0)
+  if (config.width == 0 || config.height == 0)
   {
     ROS_WARN_THROTTLE(10,"width or height config not set properly, skipping images");
     return;
   }
 
-  image->width =  (int) config_.width;
-  image->height = (int) config_.height;
-  image->step = image->width * 3;
-  if (image->step*image->height > 1920*1080*3) {
+  image->width =  (int) config.width;
+  image->height = (int) config.height;
+  // Conversions write image->encoding's pixels straight into the image; the
+  // 4-byte encodings get their constant alpha in the same pass.
+  image->encoding = OutputEncoding(config, frame->frame_format);
+  bool four_channels = image->encoding == "bgra8" || image->encoding == "rgba8";
+  size_t row_bytes = image->width * sensor_msgs::image_encodings::numChannels(image->encoding) *
+    sensor_msgs::image_encodings::bitDepth(image->encoding) / 8;
+  image->step = (row_bytes + row_alignment_ - 1) & ~(size_t) (row_alignment_ - 1);
+  if (image->step*image->height > 1920*1080*4) {
     ROS_WARN_ONCE("resize to: %d cannot be done memory requested suspiciously large",image->step*image->height);
     return;
   }
   image->data.resize(image->step * image->height);
+  if ((uintptr_t) &(image->data[0]) & (row_alignment_ - 1))
+    ROS_WARN_ONCE("image_raw buffers aren't %d-byte aligned; ~row_alignment only spaces "
+                  "their rows", row_alignment_);
+  image->header.frame_id = config.frame_id;
+  image->header.stamp = timestamp;
 
-  if (frame->frame_format == UVC_FRAME_FORMAT_BGR){
-    image->encoding = "bgr8";
-    memcpy(&(image->data[0]), frame->data, frame->data_bytes);
-  } else if (frame->frame_format == UVC_FRAME_FORMAT_RGB){
-    image->encoding = "rgb8";
-    memcpy(&(image->data[0]), frame->data, frame->data_bytes);
-  } else if (frame->frame_format == UVC_FRAME_FORMAT_UYVY) {
-    image->encoding = "yuv422";
-    memcpy(&(image->data[0]), frame->data, frame->data_bytes);
+  // Strips go out while the rest of the frame converts where the conversion
+  // can be done in bands, otherwise once the whole frame is converted.
+  int strip_rows = StripRows();
+  // Banded conversions (YUYV, BGR/RGB) are corrected band by band, while
+  // the rows are still in cache; the others (MJPEG, libuvc's conversions)
+  // in a second pass right after conversion.
+  bool correct = ConfigureIsp(config, image->encoding);
+  bool strips_published = false;
+  bool corrected = false;
+  bool publish_checked = false;
+
+  if (trace)
+    trace->convert_start_ns = FrameTracer::Now();
+  LIBUVC_CAMERA_TRACE2(convert_start, frame->sequence, frame->frame_format);
+
+  if (image->encoding == "mono8" && frame->frame_format != UVC_FRAME_FORMAT_MJPEG) {
+    if (frame->data_bytes < (size_t) image->width * image->height * 2) {
+      ROS_WARN_THROTTLE(10, "Short %s frame: %lu bytes",
+                        frame->frame_format == UVC_FRAME_FORMAT_UYVY ? "UYVY" : "YUYV",
+                        (unsigned long) frame->data_bytes);
+      LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "short_frame");
+      return;
+    }
+    PackedToMono8(static_cast<uint8_t*>(frame->data), image->width * 2,
+                  frame->frame_format == UVC_FRAME_FORMAT_UYVY,
+                  &(image->data[0]), image->step, image->width, image->height);
+  } else if ((frame->frame_format == UVC_FRAME_FORMAT_BGR ||
+              frame->frame_format == UVC_FRAME_FORMAT_RGB) && (four_channels || correct)) {
+    if (frame->data_bytes < (size_t) image->width * image->height * 3) {
+      ROS_WARN_THROTTLE(10, "Short RGB frame: %lu bytes", (unsigned long) frame->data_bytes);
+      LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "short_frame");
+      return;
+    }
+    const uint8_t *src = static_cast<uint8_t*>(frame->data);
+    size_t src_step = image->width * 3;
+    bool source_bgr = frame->frame_format == UVC_FRAME_FORMAT_BGR;
+    int band = correct ? kIspBandRows : image->height;
+    for (int row = 0; row < (int) image->height; row += band) {
+      int rows = std::min(band, (int) image->height - row);
+      uint8_t *dst = &(image->data[0]) + row * image->step;
+      if (four_channels) {
+        ExpandToFourChannels(src + row * src_step, src_step, dst, image->step,
+                             image->width, rows, source_bgr != (image->encoding == "bgra8"));
+      } else {
+        for (int i = 0; i < rows; ++i)
+          memcpy(dst + i * image->step, src + (row + i) * src_step, src_step);
+      }
+      if (correct)
+        CorrectRows(image.get(), row, rows);
+    }
+    corrected = correct;
+  } else if (frame->frame_format == UVC_FRAME_FORMAT_BGR ||
+             frame->frame_format == UVC_FRAME_FORMAT_RGB ||
+             frame->frame_format == UVC_FRAME_FORMAT_UYVY) {
+    CopyRows(frame->data, frame->data_bytes, row_bytes, image.get());
   } else if (frame->frame_format == UVC_FRAME_FORMAT_YUYV) {
-    // FIXME: uvc_any2bgr does not work on "yuyv" format, so use uvc_yuyv2bgr directly.
-    uvc_error_t conv_ret = uvc_yuyv2bgr(frame, rgb_frame_);
-    if (conv_ret != UVC_SUCCESS) {
-      const char* error_msg = uvc_strerror(conv_ret);
-      ROS_WARN("Couldn't convert frame to RGB: %s",error_msg);
+    if (yuyv_kernel_ == kYuyvKernelUvc && !four_channels) {
+      // FIXME: uvc_any2bgr does not work on "yuyv" format, so use uvc_yuyv2bgr directly.
+      uvc_error_t conv_ret = uvc_yuyv2bgr(frame, rgb_frame_);
+      if (conv_ret != UVC_SUCCESS) {
+        const char* error_msg = uvc_strerror(conv_ret);
+        ROS_WARN("Couldn't convert frame to RGB: %s",error_msg);
+        LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "convert_error");
+        return;
+      }
+      CopyRows(rgb_frame_->data, rgb_frame_->data_bytes, row_bytes, image.get());
+    } else {
+      if (frame->data_bytes < (size_t) image->width * image->height * 2) {
+        ROS_WARN_THROTTLE(10, "Short YUYV frame: %lu bytes", (unsigned long) frame->data_bytes);
+        LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "short_frame");
+        return;
+      }
+      const uint8_t *src = static_cast<uint8_t*>(frame->data);
+      size_t src_step = image->width * 2;
+      // Strips are published as they convert, so the frame has to pass the
+      // publish-side age check before the first one; motion was decided
+      // above and no error can follow.
+      if (strip_rows && IsStale(config, timestamp, &stale_publish_drops_)) {
+        LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "stale_before_publish");
+        return;
+      }
+      int band = strip_rows ? strip_rows : (correct ? kIspBandRows : image->height);
+      for (int row = 0; row < (int) image->height; row += band) {
+        int rows = std::min(band, (int) image->height - row);
+        uint8_t *dst = &(image->data[0]) + row * image->step;
+        if (four_channels)
+          YuyvToBgra(yuyv_bgra_kernel_, src + row * src_step, src_step, dst, image->step,
+                     image->width, rows, image->encoding == "rgba8");
+        else
+          YuyvToBgr(yuyv_kernel_, src + row * src_step, src_step, dst, image->step,
+                    image->width, rows);
+        if (correct)
+          CorrectRows(image.get(), row, rows);
+        if (strip_rows)
+          PublishStrip(*image, row, rows, frame->sequence, trace);
+      }
+      strips_published = strip_rows != 0;
+      publish_checked = strips_published;
+      corrected = correct;
+    }
+  }
+  else if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG && MjpegDecoder::Supported()) {
+    const uint8_t *jpeg = static_cast<uint8_t*>(frame->data);
+    bool decoded;
+    if (image->encoding == "yuv422")
+      decoded = mjpeg_decoder_.DecodeYuv422(jpeg, frame->data_bytes, image->width, image->height,
+                                            &(image->data[0]), image->step);
+    else if (four_channels)
+      decoded = mjpeg_decoder_.DecodeBgra8(jpeg, frame->data_bytes, image->width, image->height,
+                                           image->encoding == "rgba8",
+                                           &(image->data[0]), image->step);
+    else if (image->encoding == "mono8")
+      decoded = mjpeg_decoder_.DecodeMono8(jpeg, frame->data_bytes, image->width, image->height,
+                                           &(image->data[0]), image->step);
+    else
+      decoded = mjpeg_decoder_.DecodeRgb8(jpeg, frame->data_bytes, image->width, image->height,
+                                          &(image->data[0]), image->step);
+    if (!decoded) {
+      LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "convert_error");
       return;
     }
-    image->encoding = "bgr8";
-    memcpy(&(image->data[0]), rgb_frame_->data, rgb_frame_->data_bytes);
   }
 #ifdef LIBUVC_HAS_JPEG
+  // Without libjpeg of our own, fall back to libuvc's per-frame decoder.
   else if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
     uvc_error_t conv_ret = uvc_mjpeg2rgb(frame, rgb_frame_);
     if (conv_ret != UVC_SUCCESS) {
       const char* error_msg = uvc_strerror(conv_ret);
       ROS_WARN("Couldn't convert frame from MJPEG to RGB: %s",error_msg);
+      LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "convert_error");
       return;
     }
-    image->encoding = "rgb8";
-    memcpy(&(image->data[0]), rgb_frame_->data, rgb_frame_->data_bytes);
+    if (four_channels)
+      ExpandToFourChannels(static_cast<uint8_t*>(rgb_frame_->data), image->width * 3,
+                           &(image->data[0]), image->step, image->width, image->height,
+                           image->encoding == "bgra8");
+    else
+      CopyRows(rgb_frame_->data, rgb_frame_->data_bytes, row_bytes, image.get());
   }
 #endif
   else {
@@ -237,24 +926,67 @@ void CameraDriver::ImageCallback(uvc_frame_t *frame) {
     if (conv_ret != UVC_SUCCESS) {
       const char* error_msg = uvc_strerror(conv_ret);
       ROS_WARN("Couldn't convert frame to RGB: %s",error_msg);
+      LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "convert_error");
       return;
     }
-    image->encoding = "bgr8";
-    memcpy(&(image->data[0]), rgb_frame_->data, rgb_frame_->data_bytes);
+    if (four_channels)
+      ExpandToFourChannels(static_cast<uint8_t*>(rgb_frame_->data), image->width * 3,
+                           &(image->data[0]), image->step, image->width, image->height,
+                           image->encoding == "rgba8");
+    else
+      CopyRows(rgb_frame_->data, rgb_frame_->data_bytes, row_bytes, image.get());
+  }
+  if (correct && !corrected)
+    CorrectRows(image.get(), 0, image->height);
+  if (trace)
+    trace->convert_end_ns = FrameTracer::Now();
+  LIBUVC_CAMERA_TRACE1(convert_end, frame->sequence);
+
+  // Strips count as publishing: a frame dropped here sends none of them.
+  if (!publish_checked && IsStale(config, timestamp, &stale_publish_drops_)) {
+    LIBUVC_CAMERA_TRACE2(drop, frame->sequence, "stale_before_publish");
+    return;
   }
+
+  // Levels are reduced while the converted image is still in cache, before
+  // the strip, publish and bag hand-offs touch other memory.
+  PublishPyramid(*image);
+
+  if (strip_rows && !strips_published) {
+    for (int row = 0; row < (int) image->height; row += strip_rows)
+      PublishStrip(*image, row, std::min(strip_rows, (int) image->height - row),
+                   frame->sequence, trace);
+  }
+
   sensor_msgs::CameraInfo::Ptr cinfo(
     new sensor_msgs::CameraInfo(cinfo_manager_.getCameraInfo()));
-  image->header.frame_id = config_.frame_id;
-  image->header.stamp = timestamp;
-  cinfo->header.frame_id = config_.frame_id;
+  cinfo->header.frame_id = config.frame_id;
   cinfo->header.stamp = timestamp;
 
+  // Intra-process subscribers share these messages, so they must not be
+  // modified once published.
   cam_pub_.publish(image, cinfo);
+  LIBUVC_CAMERA_TRACE2(publish, frame->sequence, timestamp.toNSec());
+
+  if (motion_sampled) {
+    motion_detector_.Accept();
+    last_motion_publish_ = timestamp;
+  }
 
-  if (config_changed_) {
-    config_server_->updateConfig(config_);
+  bag_writer_.Write("image_raw", image_topic_, timestamp, image);
+  bag_writer_.Write("camera_info", camera_info_topic_, timestamp, cinfo);
+
+  if (trace)
+    trace->publish_end_ns = FrameTracer::Now();
+
+  bool config_changed;
+  {
+    boost::mutex::scoped_lock lock(config_mutex_);
+    config_changed = config_changed_;
     config_changed_ = false;
   }
+  if (config_changed)
+    config_server_->updateConfig(ConfigSnapshot());
 }
 
 /* static */ void CameraDriver::ImageCallbackAdapter(uvc_frame_t *frame, void *ptr) {
@@ -269,7 +1001,8 @@ void CameraDriver::AutoControlsCallback(
   int selector,
   enum uvc_status_attribute status_attribute,
   void *data, size_t data_len) {
-  boost::recursive_mutex::scoped_lock(mutex_);
+  // Like ProcessFrame, libuvc's status thread can't wait for mutex_.
+  boost::mutex::scoped_lock lock(config_mutex_);
 
   ROS_DEBUG("Controls callback. class: %d, event: %d, selector: %d, attr: %d, data_len: %u\n",
          status_class, event, selector, status_attribute, data_len);
@@ -341,6 +1074,90 @@ enum uvc_frame_format CameraDriver::GetVideoMode(std::string vmode){
   }
 };
 
+void CameraDriver::AllocateFrameBuffers(int width, int height, size_t raw_frame_bytes) {
+  if (rgb_frame_)
+    uvc_free_frame(rgb_frame_);
+  rgb_frame_ = NULL;
+
+  for (size_t i = 0; i < raw_frames_.size(); ++i) {
+    uvc_frame_t *raw = raw_frames_[i];
+    if (!raw->library_owns_data) {
+      raw->data = NULL;
+      raw->data_bytes = 0;
+      raw->library_owns_data = 1;
+    }
+  }
+  arena_.Release();
+
+  size_t rgb_bytes = (size_t) width * height * 3;
+
+  if (use_huge_pages_) {
+    // Blocks are 64-byte aligned; leave room for the padding.
+    size_t arena_bytes = rgb_bytes + raw_frames_.size() * raw_frame_bytes +
+      64 * (raw_frames_.size() + 1);
+
+    if (arena_.Allocate(arena_bytes)) {
+      rgb_frame_ = uvc_allocate_frame(0);
+      rgb_frame_->data = arena_.Take(rgb_bytes);
+      rgb_frame_->data_bytes = rgb_bytes;
+      rgb_frame_->library_owns_data = 0;
+
+      for (size_t i = 0; i < raw_frames_.size(); ++i) {
+        uvc_frame_t *raw = raw_frames_[i];
+        if (raw->data && raw->library_owns_data)
+          free(raw->data);
+        raw->data = arena_.Take(raw_frame_bytes);
+        raw->data_bytes = raw_frame_bytes;
+        raw->library_owns_data = 0;
+      }
+      raw_frame_bytes_ = raw_frame_bytes;
+
+      ROS_INFO("Frame buffers: %.1f MB arena on %s for the scratch frame and raw ring",
+               arena_.Size() / 1048576.0, FrameArena::ModeName(arena_.GetMode()));
+    } else {
+      ROS_WARN("Frame buffers: no arena, using the heap");
+    }
+  }
+
+  if (!rgb_frame_)
+    rgb_frame_ = uvc_allocate_frame(rgb_bytes);
+  assert(rgb_frame_);
+}
+
+void CameraDriver::SelectYuyvKernel(int width, int height) {
+  if (conversion_kernel_ == "auto") {
+    yuyv_kernel_ = PlanYuyvKernel(width, height, false, conversion_plan_cache_);
+    yuyv_bgra_kernel_ = PlanYuyvKernel(width, height, true, conversion_plan_cache_);
+    return;
+  }
+  if (!ParseYuyvKernel(conversion_kernel_, &yuyv_kernel_) ||
+      !YuyvKernelSupported(yuyv_kernel_)) {
+    ROS_WARN("Conversion kernel %s is not available, using uvc", conversion_kernel_.c_str());
+    yuyv_kernel_ = kYuyvKernelUvc;
+  }
+  yuyv_bgra_kernel_ = yuyv_kernel_;
+}
+
+enum uvc_frame_format CameraDriver::GetNegotiatedFormat(const uvc_stream_ctrl_t &ctrl) {
+  for (const uvc_format_desc_t *format = uvc_get_format_descs(devh_);
+       format; format = format->next) {
+    if (format->bFormatIndex != ctrl.bFormatIndex)
+      continue;
+
+    if (format->bDescriptorSubtype == UVC_VS_FORMAT_MJPEG)
+      return UVC_FRAME_FORMAT_MJPEG;
+
+    if (format->bDescriptorSubtype == UVC_VS_FORMAT_UNCOMPRESSED) {
+      if (!memcmp(format->guidFormat, "YUY2", 4))
+        return UVC_FRAME_FORMAT_YUYV;
+      if (!memcmp(format->guidFormat, "UYVY", 4))
+        return UVC_FRAME_FORMAT_UYVY;
+    }
+  }
+
+  return UVC_FRAME_FORMAT_UNKNOWN;
+}
+
 void CameraDriver::OpenCamera(UVCCameraConfig &new_config) {
   assert(state_ == kStopped);
 
@@ -364,7 +1181,11 @@ void CameraDriver::OpenCamera(UVCCameraConfig &new_config) {
     return;
   }
 
-  uvc_error_t open_err = uvc_open(dev_, &devh_);
+  uvc_error_t open_err;
+  {
+    boost::mutex::scoped_lock lock(ctx_devices_mutex);
+    open_err = uvc_open(dev_, &devh_);
+  }
 
   if (open_err != UVC_SUCCESS) {
     switch (open_err) {
@@ -396,6 +1217,10 @@ void CameraDriver::OpenCamera(UVCCameraConfig &new_config) {
 
   uvc_set_status_callback(devh_, &CameraDriver::AutoControlsCallbackAdapter, this);
 
+  if (!payload_capture_file_.empty())
+    payload_capture_.Start(payload_capture_file_,
+                           uvc_get_bus_number(dev_), uvc_get_device_address(dev_));
+
   uvc_stream_ctrl_t ctrl;
   uvc_error_t mode_err = uvc_get_stream_ctrl_format_size(
     devh_, &ctrl,
@@ -406,37 +1231,65 @@ void CameraDriver::OpenCamera(UVCCameraConfig &new_config) {
   if (mode_err != UVC_SUCCESS) {
     const char* error_msg = uvc_strerror(mode_err);
     ROS_WARN("uvc_get_stream_ctrl_format_size: %s",error_msg);
-    uvc_close(devh_);
+    payload_capture_.Stop();
+    {
+      boost::mutex::scoped_lock lock(ctx_devices_mutex);
+      uvc_close(devh_);
+    }
     uvc_unref_device(dev_);
     ROS_WARN("check video_mode/width/height/frame_rate are available");
     uvc_print_diag(devh_, NULL);
     return;
   }
 
+  if (GetNegotiatedFormat(ctrl) == UVC_FRAME_FORMAT_YUYV)
+    SelectYuyvKernel(new_config.width, new_config.height);
+  else
+    yuyv_kernel_ = kYuyvKernelUvc;
+
+  last_frame_time_ = ros::Time();
+  frame_period_ = 0.0;
+  motion_detector_.Reset();
+
+  // Before streaming starts, so the first callbacks find the buffers.
+  AllocateFrameBuffers(new_config.width, new_config.height,
+                       std::max((size_t) ctrl.dwMaxVideoFrameSize,
+                                (size_t) new_config.width * new_config.height * 2));
+
   uvc_error_t stream_err = uvc_start_iso_streaming(devh_, &ctrl, &CameraDriver::ImageCallbackAdapter, this);
 
   if (stream_err != UVC_SUCCESS) {
     const char* error_msg = uvc_strerror(stream_err);
     ROS_WARN("uvc_start_iso_streaming: %s",error_msg);
-    uvc_close(devh_);
+    payload_capture_.Stop();
+    {
+      boost::mutex::scoped_lock lock(ctx_devices_mutex);
+      uvc_close(devh_);
+    }
     uvc_unref_device(dev_);
     return;
   }
 
-  if (rgb_frame_)
-    uvc_free_frame(rgb_frame_);
-
-  rgb_frame_ = uvc_allocate_frame(new_config.width * new_config.height * 3);
-  assert(rgb_frame_);
-
+  LIBUVC_CAMERA_TRACE2(stream_start, vendor_id, product_id);
   state_ = kRunning;
 }
 
 void CameraDriver::CloseCamera() {
   assert(state_ == kRunning);
 
-  uvc_close(devh_);
+  {
+    boost::mutex::scoped_lock lock(ctx_devices_mutex);
+    uvc_close(devh_);
+  }
   devh_ = NULL;
+  LIBUVC_CAMERA_TRACE0(stream_stop);
+
+  payload_capture_.Stop();
+
+  // No more callbacks can arrive; let queued frames finish before the
+  // conversion buffers go away.
+  if (decode_strand_)
+    DecodePool::Instance().Flush(decode_strand_);
 
   uvc_unref_device(dev_);
   dev_ = NULL;
@@ -0,0 +1,280 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/color_conversion.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace libuvc_camera {
+
+namespace {
+
+// Chroma contributions, scaled by 2^14 as in libuvc's IYUYV2BGR macros.
+const int kCrToR = 22987;
+const int kCbToG = -5636;
+const int kCrToG = -11698;
+const int kCbToB = 29049;
+
+inline uint8_t Saturate(int value) {
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// Converts the pixel pairs in [begin, end) of one row.
+void YuyvToBgrPairs(const uint8_t *src, uint8_t *dst, int begin, int end) {
+  src += begin * 2;
+  dst += begin * 3;
+  for (int x = begin; x + 1 < end; x += 2, src += 4, dst += 6) {
+    int cb = src[1] - 128;
+    int cr = src[3] - 128;
+    int r = (kCrToR * cr) >> 14;
+    int g = (kCbToG * cb + kCrToG * cr) >> 14;
+    int b = (kCbToB * cb) >> 14;
+
+    dst[0] = Saturate(src[0] + b);
+    dst[1] = Saturate(src[0] + g);
+    dst[2] = Saturate(src[0] + r);
+    dst[3] = Saturate(src[2] + b);
+    dst[4] = Saturate(src[2] + g);
+    dst[5] = Saturate(src[2] + r);
+  }
+}
+
+// As YuyvToBgrPairs, to 4-byte pixels with alpha 255.
+void YuyvToBgraPairs(const uint8_t *src, uint8_t *dst, int begin, int end,
+                     bool swap_red_blue) {
+  int first = swap_red_blue ? 2 : 0;
+  src += begin * 2;
+  dst += begin * 4;
+  for (int x = begin; x + 1 < end; x += 2, src += 4, dst += 8) {
+    int cb = src[1] - 128;
+    int cr = src[3] - 128;
+    int r = (kCrToR * cr) >> 14;
+    int g = (kCbToG * cb + kCrToG * cr) >> 14;
+    int b = (kCbToB * cb) >> 14;
+
+    dst[first] = Saturate(src[0] + b);
+    dst[1] = Saturate(src[0] + g);
+    dst[2 - first] = Saturate(src[0] + r);
+    dst[3] = 255;
+    dst[4 + first] = Saturate(src[2] + b);
+    dst[5] = Saturate(src[2] + g);
+    dst[6 - first] = Saturate(src[2] + r);
+    dst[7] = 255;
+  }
+}
+
+void YuyvToBgrScalar(const uint8_t *src, size_t src_step,
+                     uint8_t *dst, size_t dst_step,
+                     int width, int height) {
+  for (int y = 0; y < height; ++y, src += src_step, dst += dst_step)
+    YuyvToBgrPairs(src, dst, 0, width);
+}
+
+#ifdef __SSE2__
+// Converts 8 YUYV pixels (16 bytes) to 8 BGRA pixels, or RGBA with
+// swap_red_blue, in *lo and *hi.
+inline void YuyvToBgra8(const uint8_t *src, __m128i *lo, __m128i *hi,
+                        bool swap_red_blue = false) {
+  const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+  // Luma as words Y0..Y7; chroma as words Cb0 Cr0 Cb1 Cr1 ... centred on 0
+  const __m128i luma = _mm_and_si128(s, _mm_set1_epi16(0x00ff));
+  const __m128i chroma = _mm_sub_epi16(_mm_srli_epi16(s, 8), _mm_set1_epi16(128));
+
+  // One 32-bit sum per pixel pair, with the same rounding as the scalar code
+  __m128i r = _mm_srai_epi32(_mm_madd_epi16(chroma, _mm_set_epi16(
+    kCrToR, 0, kCrToR, 0, kCrToR, 0, kCrToR, 0)), 14);
+  __m128i g = _mm_srai_epi32(_mm_madd_epi16(chroma, _mm_set_epi16(
+    kCrToG, kCbToG, kCrToG, kCbToG, kCrToG, kCbToG, kCrToG, kCbToG)), 14);
+  __m128i b = _mm_srai_epi32(_mm_madd_epi16(chroma, _mm_set_epi16(
+    0, kCbToB, 0, kCbToB, 0, kCbToB, 0, kCbToB)), 14);
+
+  // Spread each pair's value over both of its pixels' words.
+  const __m128i low_words = _mm_set1_epi32(0x0000ffff);
+  r = _mm_or_si128(_mm_and_si128(r, low_words), _mm_slli_epi32(r, 16));
+  g = _mm_or_si128(_mm_and_si128(g, low_words), _mm_slli_epi32(g, 16));
+  b = _mm_or_si128(_mm_and_si128(b, low_words), _mm_slli_epi32(b, 16));
+
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i r8 = _mm_packus_epi16(_mm_adds_epi16(luma, r), zero);
+  const __m128i g8 = _mm_packus_epi16(_mm_adds_epi16(luma, g), zero);
+  const __m128i b8 = _mm_packus_epi16(_mm_adds_epi16(luma, b), zero);
+
+  const __m128i bg = _mm_unpacklo_epi8(swap_red_blue ? r8 : b8, g8);
+  const __m128i ra = _mm_unpacklo_epi8(swap_red_blue ? b8 : r8, _mm_set1_epi8((char) 0xff));
+  *lo = _mm_unpacklo_epi16(bg, ra);
+  *hi = _mm_unpackhi_epi16(bg, ra);
+}
+
+void YuyvToBgrSse2(const uint8_t *src, size_t src_step,
+                   uint8_t *dst, size_t dst_step,
+                   int width, int height) {
+  for (int y = 0; y < height; ++y, src += src_step, dst += dst_step) {
+    // Pixels are stored 4 bytes at a time, one byte past their end. Keep the
+    // last group of the image for the scalar tail so that never leaves the
+    // buffer.
+    int vector_end = (y == height - 1) ? width - 8 : width - 7;
+
+    int x = 0;
+    for (; x < vector_end; x += 8) {
+      __m128i lo, hi;
+      YuyvToBgra8(src + x * 2, &lo, &hi);
+
+      uint32_t bgra[8];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(bgra), lo);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(bgra + 4), hi);
+
+      uint8_t *out = dst + x * 3;
+      for (int i = 0; i < 8; ++i)
+        memcpy(out + i * 3, &bgra[i], 4);
+    }
+
+    YuyvToBgrPairs(src, dst, x, width);
+  }
+}
+
+void YuyvToBgraSse2(const uint8_t *src, size_t src_step,
+                    uint8_t *dst, size_t dst_step,
+                    int width, int height, bool swap_red_blue) {
+  for (int y = 0; y < height; ++y, src += src_step, dst += dst_step) {
+    // 4-byte pixels need no shuffling; each group is two plain stores.
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      __m128i lo, hi;
+      YuyvToBgra8(src + x * 2, &lo, &hi, swap_red_blue);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), lo);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4 + 16), hi);
+    }
+
+    YuyvToBgraPairs(src, dst, x, width, swap_red_blue);
+  }
+}
+#endif
+
+}
+
+const char *YuyvKernelName(YuyvKernel kernel) {
+  switch (kernel) {
+  case kYuyvKernelUvc: return "uvc";
+  case kYuyvKernelScalar: return "scalar";
+  case kYuyvKernelSse2: return "sse2";
+  default: return "unknown";
+  }
+}
+
+bool ParseYuyvKernel(const std::string &name, YuyvKernel *kernel) {
+  for (int i = 0; i < kNumYuyvKernels; ++i) {
+    if (name == YuyvKernelName((YuyvKernel) i)) {
+      *kernel = (YuyvKernel) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool YuyvKernelSupported(YuyvKernel kernel) {
+  switch (kernel) {
+  case kYuyvKernelUvc:
+  case kYuyvKernelScalar:
+    return true;
+  case kYuyvKernelSse2:
+#ifdef __SSE2__
+    return true;
+#else
+    return false;
+#endif
+  default:
+    return false;
+  }
+}
+
+void YuyvToBgr(YuyvKernel kernel,
+               const uint8_t *src, size_t src_step,
+               uint8_t *dst, size_t dst_step,
+               int width, int height) {
+  switch (kernel) {
+#ifdef __SSE2__
+  case kYuyvKernelSse2:
+    YuyvToBgrSse2(src, src_step, dst, dst_step, width, height);
+    break;
+#endif
+  default:
+    YuyvToBgrScalar(src, src_step, dst, dst_step, width, height);
+    break;
+  }
+}
+
+void YuyvToBgra(YuyvKernel kernel,
+                const uint8_t *src, size_t src_step,
+                uint8_t *dst, size_t dst_step,
+                int width, int height, bool swap_red_blue) {
+#ifdef __SSE2__
+  if (kernel == kYuyvKernelSse2) {
+    YuyvToBgraSse2(src, src_step, dst, dst_step, width, height, swap_red_blue);
+    return;
+  }
+#endif
+  for (int y = 0; y < height; ++y, src += src_step, dst += dst_step)
+    YuyvToBgraPairs(src, dst, 0, width, swap_red_blue);
+}
+
+void ExpandToFourChannels(const uint8_t *src, size_t src_step,
+                          uint8_t *dst, size_t dst_step,
+                          int width, int height, bool swap_red_blue) {
+  int first = swap_red_blue ? 2 : 0;
+  for (int y = 0; y < height; ++y, src += src_step, dst += dst_step) {
+    // Back to front, so that in place no pixel is overwritten before it's read
+    for (int x = width - 1; x >= 0; --x) {
+      uint8_t c0 = src[x * 3], c1 = src[x * 3 + 1], c2 = src[x * 3 + 2];
+      dst[x * 4 + first] = c0;
+      dst[x * 4 + 1] = c1;
+      dst[x * 4 + 2 - first] = c2;
+      dst[x * 4 + 3] = 255;
+    }
+  }
+}
+
+void PackedToMono8(const uint8_t *src, size_t src_step, bool uyvy,
+                   uint8_t *dst, size_t dst_step, int width, int height) {
+  src += uyvy ? 1 : 0;
+  for (int y = 0; y < height; ++y, src += src_step, dst += dst_step) {
+    for (int x = 0; x < width; ++x)
+      dst[x] = src[x * 2];
+  }
+}
+
+};
@@ -0,0 +1,252 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/conversion_planner.h"
+
+#include <ros/ros.h>
+#include <libuvc/libuvc.h>
+#include <boost/thread/mutex.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace libuvc_camera {
+
+namespace {
+
+const int kBenchmarkRuns = 5;
+const double kBenchmarkBudget = 0.1;  // Seconds per kernel
+
+// Held across lookup, benchmark and store
+boost::mutex plan_mutex;
+
+// /proc/cpuinfo's model name with spaces replaced, so that a home directory
+// shared between machines doesn't mix their plans.
+std::string CpuModel() {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") != 0)
+      continue;
+    size_t colon = line.find(':');
+    size_t start = line.find_first_not_of(" \t", colon == std::string::npos ? line.size() : colon + 1);
+    if (start == std::string::npos)
+      break;
+    std::string model = line.substr(start);
+    std::replace(model.begin(), model.end(), ' ', '_');
+    std::replace(model.begin(), model.end(), '\t', '_');
+    return model;
+  }
+  return "unknown";
+}
+
+std::string PlanKey(int width, int height, bool four_channels) {
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0)
+    strcpy(host, "unknown");
+  host[sizeof(host) - 1] = '\0';
+
+  std::ostringstream key;
+  key << host << " " << CpuModel() << " yuyv " << (four_channels ? "bgra8 " : "bgr8 ")
+      << width << "x" << height;
+  return key.str();
+}
+
+bool LoadPlan(const std::string &cache_path, const std::string &key, YuyvKernel *kernel) {
+  std::ifstream cache(cache_path.c_str());
+  std::string line;
+  while (std::getline(cache, line)) {
+    if (line.compare(0, key.size() + 1, key + " ") != 0)
+      continue;
+
+    std::istringstream fields(line.substr(key.size() + 1));
+    std::string name;
+    fields >> name;
+    return ParseYuyvKernel(name, kernel) && YuyvKernelSupported(*kernel);
+  }
+  return false;
+}
+
+void StorePlan(const std::string &cache_path, const std::string &key,
+               YuyvKernel kernel, double seconds) {
+  std::vector<std::string> lines;
+  {
+    std::ifstream cache(cache_path.c_str());
+    std::string line;
+    while (std::getline(cache, line)) {
+      if (line.compare(0, key.size() + 1, key + " ") != 0)
+        lines.push_back(line);
+    }
+  }
+
+  std::ostringstream entry;
+  entry << key << " " << YuyvKernelName(kernel) << " " << (int) (seconds * 1e6) << "us";
+  lines.push_back(entry.str());
+
+  std::string contents;
+  for (size_t i = 0; i < lines.size(); ++i)
+    contents += lines[i] + "\n";
+
+  // Drivers starting in parallel share the cache, so write a private copy
+  // and rename it into place; readers see either the old or the new file.
+  // Concurrent updates can still drop each other's entries, which only
+  // costs a benchmark at the next start.
+  std::vector<char> temp_path(cache_path.begin(), cache_path.end());
+  const char suffix[] = ".XXXXXX";
+  temp_path.insert(temp_path.end(), suffix, suffix + sizeof(suffix));
+  int fd = mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    ROS_WARN("Couldn't write conversion plan cache %s", cache_path.c_str());
+    return;
+  }
+
+  // mkstemp creates the file private to us; the cache never was.
+  fchmod(fd, 0644);
+  bool written = write(fd, contents.data(), contents.size()) == (ssize_t) contents.size();
+  written = close(fd) == 0 && written;
+  if (!written || rename(&temp_path[0], cache_path.c_str()) != 0) {
+    ROS_WARN("Couldn't write conversion plan cache %s", cache_path.c_str());
+    unlink(&temp_path[0]);
+  }
+}
+
+// Best of a few runs of one kernel on a synthetic frame.
+double TimeKernel(YuyvKernel kernel, bool four_channels, uvc_frame_t *yuyv,
+                  uvc_frame_t *scratch, std::vector<uint8_t> *image, int width, int height) {
+  double best = 1e9;
+  ros::WallTime budget_end = ros::WallTime::now() + ros::WallDuration(kBenchmarkBudget);
+
+  // The first run is a warm-up and isn't counted.
+  for (int run = -1; run < kBenchmarkRuns; ++run) {
+    ros::WallTime start = ros::WallTime::now();
+
+    if (four_channels) {
+      YuyvToBgra(kernel, static_cast<uint8_t*>(yuyv->data), width * 2,
+                 &(*image)[0], width * 4, width, height, false);
+    } else if (kernel == kYuyvKernelUvc) {
+      uvc_yuyv2bgr(yuyv, scratch);
+      memcpy(&(*image)[0], scratch->data, scratch->data_bytes);
+    } else {
+      YuyvToBgr(kernel, static_cast<uint8_t*>(yuyv->data), width * 2,
+                &(*image)[0], width * 3, width, height);
+    }
+
+    ros::WallTime end = ros::WallTime::now();
+    if (run >= 0)
+      best = std::min(best, (end - start).toSec());
+    if (end > budget_end && run >= 0)
+      break;
+  }
+
+  return best;
+}
+
+}
+
+std::string DefaultPlanCachePath() {
+  const char *ros_home = getenv("ROS_HOME");
+  if (ros_home)
+    return std::string(ros_home) + "/libuvc_camera_plans";
+
+  const char *home = getenv("HOME");
+  return std::string(home ? home : ".") + "/.ros/libuvc_camera_plans";
+}
+
+YuyvKernel PlanYuyvKernel(int width, int height, bool four_channels,
+                          const std::string &cache_path) {
+  const char *output = four_channels ? "bgra8" : "bgr8";
+  std::string key = PlanKey(width, height, four_channels);
+
+  // A driver that waited here usually finds the plan its predecessor stored.
+  boost::mutex::scoped_lock lock(plan_mutex);
+
+  YuyvKernel kernel;
+  if (!cache_path.empty() && LoadPlan(cache_path, key, &kernel)) {
+    ROS_INFO("Using cached YUYV to %s conversion kernel for %dx%d: %s",
+             output, width, height, YuyvKernelName(kernel));
+    return kernel;
+  }
+
+  // Synthetic frame: a gradient with varying chroma so that saturation and
+  // all arithmetic paths are exercised.
+  uvc_frame_t *yuyv = uvc_allocate_frame(width * height * 2);
+  uvc_frame_t *scratch = uvc_allocate_frame(width * height * 3);
+  yuyv->width = width;
+  yuyv->height = height;
+  yuyv->frame_format = UVC_FRAME_FORMAT_YUYV;
+  yuyv->step = width * 2;
+  yuyv->data_bytes = width * height * 2;
+  uint8_t *data = static_cast<uint8_t*>(yuyv->data);
+  for (size_t i = 0; i < yuyv->data_bytes; ++i)
+    data[i] = (uint8_t) (i * 7 + (i >> 11));
+
+  std::vector<uint8_t> image(width * height * (four_channels ? 4 : 3));
+
+  // libuvc has no 4-byte conversion; its kernel would just time scalar again.
+  YuyvKernel best_kernel = four_channels ? kYuyvKernelScalar : kYuyvKernelUvc;
+  double best_time = 1e9;
+  std::ostringstream report;
+
+  for (int i = 0; i < kNumYuyvKernels; ++i) {
+    YuyvKernel candidate = (YuyvKernel) i;
+    if (!YuyvKernelSupported(candidate) || (four_channels && candidate == kYuyvKernelUvc))
+      continue;
+
+    double seconds = TimeKernel(candidate, four_channels, yuyv, scratch, &image, width, height);
+    report << " " << YuyvKernelName(candidate) << "=" << (int) (seconds * 1e6) << "us";
+    if (seconds < best_time) {
+      best_time = seconds;
+      best_kernel = candidate;
+    }
+  }
+
+  uvc_free_frame(yuyv);
+  uvc_free_frame(scratch);
+
+  ROS_INFO("YUYV to %s conversion kernel for %dx%d: %s (timings:%s)",
+           output, width, height, YuyvKernelName(best_kernel), report.str().c_str());
+
+  if (!cache_path.empty())
+    StorePlan(cache_path, key, best_kernel, best_time);
+
+  return best_kernel;
+}
+
+};
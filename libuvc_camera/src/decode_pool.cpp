@@ -0,0 +1,172 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/decode_pool.h"
+
+#include <boost/bind.hpp>
+
+namespace libuvc_camera {
+
+namespace {
+
+boost::mutex instance_mutex;
+// Never destroyed: workers may still be parked when static destructors run.
+DecodePool *instance = NULL;
+
+}
+
+/* static */ DecodePool &DecodePool::Instance(int num_threads) {
+  boost::mutex::scoped_lock lock(instance_mutex);
+  if (!instance)
+    instance = new DecodePool(num_threads);
+  return *instance;
+}
+
+DecodePool::DecodePool(int num_threads)
+  : pending_(0), next_worker_(0) {
+  if (num_threads <= 0)
+    num_threads = boost::thread::hardware_concurrency();
+  if (num_threads <= 0)
+    num_threads = 1;
+
+  for (int i = 0; i < num_threads; ++i)
+    workers_.push_back(boost::shared_ptr<Worker>(new Worker()));
+
+  for (int i = 0; i < num_threads; ++i)
+    threads_.create_thread(boost::bind(&DecodePool::WorkerLoop, this, (size_t) i));
+}
+
+DecodePool::StrandPtr DecodePool::CreateStrand(int weight) {
+  return StrandPtr(new Strand(weight > 0 ? weight : 1));
+}
+
+void DecodePool::Submit(const StrandPtr &strand, const Task &task) {
+  {
+    boost::mutex::scoped_lock lock(strand->mutex_);
+    strand->tasks_.push_back(task);
+    if (strand->scheduled_)
+      return;
+    strand->scheduled_ = true;
+  }
+
+  Schedule(__sync_fetch_and_add(&next_worker_, 1) % workers_.size(), strand);
+}
+
+void DecodePool::Flush(const StrandPtr &strand) {
+  boost::mutex::scoped_lock lock(strand->mutex_);
+  while (strand->scheduled_)
+    strand->idle_.wait(lock);
+}
+
+void DecodePool::Schedule(size_t worker, const StrandPtr &strand) {
+  // The push and the count happen under the worker's mutex, like PopStrand's
+  // pop and decrement, so pending_ never counts a strand no queue holds yet
+  // and a woken worker doesn't spin waiting for the push to land.
+  {
+    boost::mutex::scoped_lock lock(workers_[worker]->mutex);
+    workers_[worker]->strands.push_back(strand);
+    boost::mutex::scoped_lock wake_lock(wake_mutex_);
+    ++pending_;
+  }
+  wake_.notify_one();
+}
+
+bool DecodePool::PopStrand(size_t worker, StrandPtr *strand) {
+  // Own queue first, oldest strand first; otherwise steal the newest strand
+  // from the next worker that has one.
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    Worker &victim = *workers_[(worker + i) % workers_.size()];
+    boost::mutex::scoped_lock lock(victim.mutex);
+    if (victim.strands.empty())
+      continue;
+
+    if (i == 0) {
+      *strand = victim.strands.front();
+      victim.strands.pop_front();
+    } else {
+      *strand = victim.strands.back();
+      victim.strands.pop_back();
+    }
+
+    boost::mutex::scoped_lock wake_lock(wake_mutex_);
+    --pending_;
+    return true;
+  }
+
+  return false;
+}
+
+void DecodePool::RunStrand(size_t worker, const StrandPtr &strand) {
+  for (int i = 0; i < strand->weight_; ++i) {
+    Task task;
+    {
+      boost::mutex::scoped_lock lock(strand->mutex_);
+      if (strand->tasks_.empty()) {
+        strand->scheduled_ = false;
+        strand->idle_.notify_all();
+        return;
+      }
+      task.swap(strand->tasks_.front());
+      strand->tasks_.pop_front();
+    }
+    task();
+  }
+
+  {
+    boost::mutex::scoped_lock lock(strand->mutex_);
+    if (strand->tasks_.empty()) {
+      strand->scheduled_ = false;
+      strand->idle_.notify_all();
+      return;
+    }
+  }
+
+  // Quantum used up; go to the back of the line.
+  Schedule(worker, strand);
+}
+
+void DecodePool::WorkerLoop(size_t worker) {
+  for (;;) {
+    StrandPtr strand;
+    if (PopStrand(worker, &strand)) {
+      RunStrand(worker, strand);
+      continue;
+    }
+
+    boost::mutex::scoped_lock lock(wake_mutex_);
+    while (pending_ == 0)
+      wake_.wait(lock);
+  }
+}
+
+};
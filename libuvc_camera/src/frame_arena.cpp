@@ -0,0 +1,139 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/frame_arena.h"
+
+#include <ros/ros.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+namespace libuvc_camera {
+
+namespace {
+
+const size_t kBlockAlignment = 64;
+
+size_t RoundUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+}
+
+FrameArena::FrameArena()
+  : base_(NULL), size_(0), used_(0), mode_(kNone) {
+}
+
+FrameArena::~FrameArena() {
+  Release();
+}
+
+bool FrameArena::Allocate(size_t bytes) {
+  Release();
+
+  size_t size = RoundUp(bytes, kHugePageSize);
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+  if (map != MAP_FAILED) {
+    base_ = static_cast<uint8_t*>(map);
+    size_ = size;
+    mode_ = kHugeTlb;
+    return true;
+  }
+  int hugetlb_err = errno;
+
+  // Over-map so the arena can start on a huge page boundary, which
+  // transparent huge pages need, then trim the slack.
+  map = mmap(NULL, size + kHugePageSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    ROS_WARN("Can't map %lu byte frame arena: %s", (unsigned long) size, strerror(errno));
+    return false;
+  }
+
+  uint8_t *start = static_cast<uint8_t*>(map);
+  uint8_t *aligned = reinterpret_cast<uint8_t*>(
+    RoundUp(reinterpret_cast<uintptr_t>(start), kHugePageSize));
+  if (aligned > start)
+    munmap(start, aligned - start);
+  if (aligned + size < start + size + kHugePageSize)
+    munmap(aligned + size, start + size + kHugePageSize - (aligned + size));
+
+  base_ = aligned;
+  size_ = size;
+
+#ifdef MADV_HUGEPAGE
+  mode_ = madvise(base_, size_, MADV_HUGEPAGE) == 0 ? kTransparentHuge : kRegularPages;
+#else
+  mode_ = kRegularPages;
+#endif
+
+  // Fault everything in now rather than on the first frames.
+  memset(base_, 0, size_);
+
+  ROS_DEBUG("MAP_HUGETLB failed (%s); frame arena uses %s",
+            strerror(hugetlb_err), ModeName(mode_));
+  return true;
+}
+
+void FrameArena::Release() {
+  if (base_)
+    munmap(base_, size_);
+  base_ = NULL;
+  size_ = 0;
+  used_ = 0;
+  mode_ = kNone;
+}
+
+void *FrameArena::Take(size_t bytes) {
+  size_t start = RoundUp(used_, kBlockAlignment);
+  if (!base_ || start + bytes > size_)
+    return NULL;
+
+  used_ = start + bytes;
+  return base_ + start;
+}
+
+const char *FrameArena::ModeName(Mode mode) {
+  switch (mode) {
+  case kNone: return "none";
+  case kHugeTlb: return "explicit huge pages";
+  case kTransparentHuge: return "transparent huge pages";
+  case kRegularPages: return "regular pages";
+  default: return "unknown";
+  }
+}
+
+};
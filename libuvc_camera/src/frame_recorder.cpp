@@ -0,0 +1,349 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/frame_recorder.h"
+
+#include <ros/ros.h>
+#include <boost/bind.hpp>
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef LIBUVC_CAMERA_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef LIBUVC_CAMERA_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace libuvc_camera {
+
+namespace {
+
+const double kReportInterval = 10.0;  // Seconds
+
+bool IndexBefore(const FrameRecordingIndexEntry &a, const FrameRecordingIndexEntry &b) {
+  return a.sequence < b.sequence;
+}
+
+}
+
+FrameRecorder::FrameRecorder()
+  : file_(NULL), codec_(kFrameRecordingLz4), level_(1), num_threads_(0), stop_(false),
+    max_frame_age_(0.0), stale_drops_(0),
+    write_offset_(0), frames_(0), drops_(0), raw_bytes_(0), compressed_bytes_(0),
+    compress_seconds_(0.0), report_start_(0.0), report_compress_seconds_(0.0),
+    report_frames_(0) {
+}
+
+FrameRecorder::~FrameRecorder() {
+  Close();
+}
+
+bool FrameRecorder::CodecSupported(FrameRecordingCodec codec) {
+  switch (codec) {
+#ifdef LIBUVC_CAMERA_HAVE_LZ4
+  case kFrameRecordingLz4:
+    return true;
+#endif
+#ifdef LIBUVC_CAMERA_HAVE_ZSTD
+  case kFrameRecordingZstd:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+bool FrameRecorder::ParseCodec(const std::string &name, FrameRecordingCodec *codec) {
+  if (name == "lz4")
+    *codec = kFrameRecordingLz4;
+  else if (name == "zstd")
+    *codec = kFrameRecordingZstd;
+  else
+    return false;
+  return true;
+}
+
+bool FrameRecorder::Open(const std::string &path, FrameRecordingCodec codec, int level,
+                         int num_threads, int queue_depth) {
+  Close();
+
+  if (!CodecSupported(codec)) {
+    ROS_WARN("Frame recording codec %d was not built in", (int) codec);
+    return false;
+  }
+
+  file_ = fopen(path.c_str(), "wb");
+  if (!file_) {
+    ROS_WARN("Can't open frame recording %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  FrameRecordingHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kFrameRecordingMagic, sizeof(header.magic));
+  header.version = kFrameRecordingVersion;
+  header.codec = codec;
+  fwrite(&header, sizeof(header), 1, file_);
+
+  codec_ = codec;
+  level_ = level;
+  num_threads_ = std::max(num_threads, 1);
+  write_offset_ = sizeof(header);
+  frames_ = drops_ = stale_drops_ = report_frames_ = 0;
+  raw_bytes_ = compressed_bytes_ = 0;
+  compress_seconds_ = report_compress_seconds_ = 0.0;
+  report_start_ = ros::WallTime::now().toSec();
+  index_.clear();
+
+  for (int i = 0; i < std::max(queue_depth, num_threads_); ++i)
+    jobs_.push_back(new Job());
+  free_jobs_ = jobs_;
+
+  stop_ = false;
+  for (int i = 0; i < num_threads_; ++i)
+    workers_.create_thread(boost::bind(&FrameRecorder::WorkerLoop, this));
+
+  return true;
+}
+
+void FrameRecorder::Close() {
+  if (!file_)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+  queue_cond_.notify_all();
+  workers_.join_all();
+
+  std::sort(index_.begin(), index_.end(), IndexBefore);
+
+  FrameRecordingTrailer trailer;
+  memcpy(trailer.magic, kFrameRecordingIndexMagic, sizeof(trailer.magic));
+  trailer.index_offset = write_offset_;
+  trailer.num_frames = index_.size();
+  if (!index_.empty())
+    fwrite(&index_[0], sizeof(index_[0]), index_.size(), file_);
+  fwrite(&trailer, sizeof(trailer), 1, file_);
+  fclose(file_);
+  file_ = NULL;
+
+  ReportStats();
+
+  for (size_t i = 0; i < jobs_.size(); ++i)
+    delete jobs_[i];
+  jobs_.clear();
+  free_jobs_.clear();
+  index_.clear();
+}
+
+void FrameRecorder::Submit(uvc_frame_t *frame, uint64_t stamp_ns) {
+  Job *job = NULL;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (free_jobs_.empty()) {
+      ++drops_;
+      ROS_WARN_THROTTLE(10, "Frame recording can't keep up, dropped %lu frames so far", drops_);
+      return;
+    }
+    job = free_jobs_.back();
+    free_jobs_.pop_back();
+  }
+
+  job->entry.stamp_ns = stamp_ns;
+  job->entry.sequence = frame->sequence;
+  job->entry.frame_format = frame->frame_format;
+  job->entry.width = frame->width;
+  job->entry.height = frame->height;
+  job->entry.step = frame->step;
+  job->entry.raw_bytes = frame->data_bytes;
+  job->entry.compressed_bytes = 0;
+  job->entry.reserved = 0;
+  job->raw.assign(static_cast<uint8_t*>(frame->data),
+                  static_cast<uint8_t*>(frame->data) + frame->data_bytes);
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    queue_.push_back(job);
+  }
+  queue_cond_.notify_one();
+}
+
+void FrameRecorder::SetMaxFrameAge(double seconds) {
+  boost::mutex::scoped_lock lock(mutex_);
+  max_frame_age_ = seconds;
+}
+
+void FrameRecorder::WorkerLoop() {
+  void *context = NULL;
+#ifdef LIBUVC_CAMERA_HAVE_ZSTD
+  if (codec_ == kFrameRecordingZstd)
+    context = ZSTD_createCCtx();
+#endif
+
+  for (;;) {
+    Job *job;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (queue_.empty() && !stop_)
+        queue_cond_.wait(lock);
+      if (queue_.empty())
+        break;
+      job = queue_.front();
+      queue_.pop_front();
+
+      if (max_frame_age_ > 0.0 &&
+          (int64_t) (ros::Time::now().toNSec() - job->entry.stamp_ns) / 1e9 > max_frame_age_) {
+        ++stale_drops_;
+        ROS_WARN_THROTTLE(10, "Frame recording dropped %lu stale frames so far", stale_drops_);
+        free_jobs_.push_back(job);
+        continue;
+      }
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    bool ok = Compress(context, job);
+    double seconds = (ros::WallTime::now() - start).toSec();
+
+    if (ok)
+      Write(job, seconds);
+    else
+      ROS_WARN_THROTTLE(10, "Couldn't compress frame %u for recording", job->entry.sequence);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    free_jobs_.push_back(job);
+  }
+
+#ifdef LIBUVC_CAMERA_HAVE_ZSTD
+  if (context)
+    ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(context));
+#endif
+}
+
+bool FrameRecorder::Compress(void *context, Job *job) {
+  int raw_bytes = (int) job->raw.size();
+  const char *raw = reinterpret_cast<const char*>(job->raw.empty() ? NULL : &job->raw[0]);
+
+  switch (codec_) {
+#ifdef LIBUVC_CAMERA_HAVE_LZ4
+  case kFrameRecordingLz4: {
+    job->compressed.resize(LZ4_compressBound(raw_bytes));
+    int bytes = LZ4_compress_fast(raw, reinterpret_cast<char*>(&job->compressed[0]),
+                                  raw_bytes, (int) job->compressed.size(),
+                                  std::max(level_, 1));
+    if (bytes <= 0)
+      return false;
+    job->compressed.resize(bytes);
+    break;
+  }
+#endif
+#ifdef LIBUVC_CAMERA_HAVE_ZSTD
+  case kFrameRecordingZstd: {
+    job->compressed.resize(ZSTD_compressBound(raw_bytes));
+    size_t bytes = ZSTD_compressCCtx(static_cast<ZSTD_CCtx*>(context),
+                                     &job->compressed[0], job->compressed.size(),
+                                     raw, raw_bytes, level_);
+    if (ZSTD_isError(bytes))
+      return false;
+    job->compressed.resize(bytes);
+    break;
+  }
+#endif
+  default:
+    return false;
+  }
+
+  job->entry.compressed_bytes = job->compressed.size();
+  return true;
+}
+
+void FrameRecorder::Write(Job *job, double compress_seconds) {
+  boost::mutex::scoped_lock lock(write_mutex_);
+
+  FrameRecordingIndexEntry index_entry;
+  index_entry.stamp_ns = job->entry.stamp_ns;
+  index_entry.offset = write_offset_;
+  index_entry.sequence = job->entry.sequence;
+  index_entry.reserved = 0;
+
+  if (fwrite(&job->entry, sizeof(job->entry), 1, file_) != 1 ||
+      fwrite(&job->compressed[0], 1, job->compressed.size(), file_) != job->compressed.size()) {
+    ROS_WARN_THROTTLE(10, "Couldn't write frame %u to recording", job->entry.sequence);
+    return;
+  }
+
+  index_.push_back(index_entry);
+  write_offset_ += sizeof(job->entry) + job->compressed.size();
+
+  ++frames_;
+  ++report_frames_;
+  raw_bytes_ += job->raw.size();
+  compressed_bytes_ += job->compressed.size();
+  compress_seconds_ += compress_seconds;
+  report_compress_seconds_ += compress_seconds;
+
+  if (ros::WallTime::now().toSec() - report_start_ >= kReportInterval) {
+    ReportStats();
+    report_start_ = ros::WallTime::now().toSec();
+    report_compress_seconds_ = 0.0;
+    report_frames_ = 0;
+  }
+}
+
+// Headroom is how much faster than the incoming frame rate the workers
+// could compress: the worker time available in the report interval over
+// the time spent compressing. Below 1 the recorder is falling behind.
+void FrameRecorder::ReportStats() {
+  // Submit and the workers count drops under mutex_, not write_mutex_.
+  unsigned long drops;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    drops = drops_ + stale_drops_;
+  }
+  double elapsed = ros::WallTime::now().toSec() - report_start_;
+  double ratio = compressed_bytes_ ? (double) raw_bytes_ / compressed_bytes_ : 0.0;
+  double headroom = report_compress_seconds_ > 0.0 ?
+    num_threads_ * elapsed / report_compress_seconds_ : 0.0;
+
+  ROS_INFO("Frame recording: %lu frames, %.1f MB -> %.1f MB (ratio %.2f), "
+           "%.1f ms/frame, headroom %.1fx, %lu dropped",
+           frames_, raw_bytes_ / 1e6, compressed_bytes_ / 1e6, ratio,
+           report_frames_ ? 1000.0 * report_compress_seconds_ / report_frames_ : 0.0,
+           headroom, drops);
+}
+
+};
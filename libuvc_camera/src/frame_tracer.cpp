@@ -0,0 +1,144 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/frame_tracer.h"
+
+#include <ros/ros.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace libuvc_camera {
+
+FrameTracer::FrameTracer()
+  : header_(NULL), records_(NULL), map_size_(0) {
+}
+
+FrameTracer::~FrameTracer() {
+  Close();
+}
+
+bool FrameTracer::Open(const std::string &path, uint32_t capacity) {
+  Close();
+
+  if (capacity == 0)
+    return false;
+
+  size_t size = sizeof(FrameTraceHeader) + (size_t) capacity * sizeof(FrameTraceRecord);
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ROS_WARN("Can't open trace file %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Reserve the blocks now so the frame path never extends the file.
+  int alloc_err = posix_fallocate(fd, 0, size);
+  if (alloc_err != 0) {
+    ROS_WARN("Can't allocate %lu bytes for trace file %s: %s",
+             (unsigned long) size, path.c_str(), strerror(alloc_err));
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ROS_WARN("Can't map trace file %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Touch every page up front so recording doesn't take page faults.
+  memset(map, 0, size);
+
+  header_ = static_cast<FrameTraceHeader*>(map);
+  records_ = reinterpret_cast<FrameTraceRecord*>(header_ + 1);
+  map_size_ = size;
+
+  memcpy(header_->magic, kFrameTraceMagic, sizeof(header_->magic));
+  header_->version = kFrameTraceVersion;
+  header_->record_size = sizeof(FrameTraceRecord);
+  header_->capacity = capacity;
+  header_->next_index = 0;
+
+  return true;
+}
+
+void FrameTracer::Close() {
+  if (!header_)
+    return;
+
+  msync(header_, map_size_, MS_SYNC);
+  munmap(header_, map_size_);
+
+  header_ = NULL;
+  records_ = NULL;
+  map_size_ = 0;
+}
+
+FrameTraceRecord *FrameTracer::Begin(uint32_t sequence, uint32_t payload_bytes,
+                                     uint64_t usb_receive_ns) {
+  if (!header_)
+    return NULL;
+
+  uint64_t index = __sync_fetch_and_add(&header_->next_index, 1);
+  FrameTraceRecord *record = &records_[index % header_->capacity];
+
+  record->index = 0;
+  __sync_synchronize();
+
+  record->usb_receive_ns = usb_receive_ns;
+  record->callback_ns = Now();
+  record->convert_start_ns = 0;
+  record->convert_end_ns = 0;
+  record->publish_end_ns = 0;
+  record->first_strip_ns = 0;
+  record->sequence = sequence;
+  record->payload_bytes = payload_bytes;
+  record->claimed_index = index + 1;
+
+  return record;
+}
+
+void FrameTracer::Commit(FrameTraceRecord *record) {
+  if (!record)
+    return;
+
+  __sync_synchronize();
+  record->index = record->claimed_index;
+}
+
+};
@@ -0,0 +1,309 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/h264_encoder.h"
+
+#include <string.h>
+
+#ifdef LIBUVC_CAMERA_HAVE_X264
+extern "C" {
+#include <x264.h>
+}
+#endif
+
+namespace libuvc_camera {
+
+#ifdef LIBUVC_CAMERA_HAVE_X264
+namespace {
+
+// Splits packed 4:2:2 into I420 planes, averaging the chroma of each pair
+// of rows; width and height are even. y_offset is the byte of the first luma sample in each 4-byte
+// group; u_offset and v_offset those of the chroma samples.
+void PackedToI420(const uint8_t *src, int width, int height,
+                  int y_offset, int u_offset, int v_offset,
+                  const x264_image_t &dst) {
+  size_t src_step = width * 2;
+  for (int y = 0; y + 1 < height; y += 2) {
+    const uint8_t *row0 = src + y * src_step;
+    const uint8_t *row1 = row0 + src_step;
+    uint8_t *luma0 = dst.plane[0] + y * dst.i_stride[0];
+    uint8_t *luma1 = luma0 + dst.i_stride[0];
+    uint8_t *u = dst.plane[1] + (y / 2) * dst.i_stride[1];
+    uint8_t *v = dst.plane[2] + (y / 2) * dst.i_stride[2];
+
+    for (int x = 0; x + 1 < width; x += 2, row0 += 4, row1 += 4) {
+      luma0[x] = row0[y_offset];
+      luma0[x + 1] = row0[y_offset + 2];
+      luma1[x] = row1[y_offset];
+      luma1[x + 1] = row1[y_offset + 2];
+      u[x / 2] = (row0[u_offset] + row1[u_offset] + 1) >> 1;
+      v[x / 2] = (row0[v_offset] + row1[v_offset] + 1) >> 1;
+    }
+  }
+}
+
+}
+#endif
+
+H264Encoder::H264Encoder()
+  : running_(false), has_pending_(false), stop_(false), drops_(0), max_frame_age_(0.0),
+    stale_drops_(0), force_next_keyframe_(false),
+    encoder_(NULL), picture_(NULL), encoder_width_(0), encoder_height_(0),
+    encoder_frame_rate_(0.0), pts_(0) {
+}
+
+H264Encoder::~H264Encoder() {
+  Stop();
+}
+
+bool H264Encoder::Supported() {
+#ifdef LIBUVC_CAMERA_HAVE_X264
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool H264Encoder::Start(const Options &options, const PacketCallback &callback) {
+  Stop();
+
+  if (!Supported()) {
+    ROS_WARN("H.264 output requested, but this build has no x264");
+    return false;
+  }
+
+  options_ = options;
+  callback_ = callback;
+  has_pending_ = false;
+  stop_ = false;
+  drops_ = 0;
+  stale_drops_ = 0;
+  force_next_keyframe_ = false;
+  running_ = true;
+  thread_ = boost::thread(&H264Encoder::EncodeLoop, this);
+  return true;
+}
+
+void H264Encoder::Stop() {
+  if (!running_)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+  pending_cond_.notify_all();
+  thread_.join();
+  running_ = false;
+}
+
+void H264Encoder::Submit(uvc_frame_t *frame, const std::string &frame_id, ros::Time stamp,
+                         double frame_rate, bool force_keyframe) {
+  if (!running_ || !CanEncode(frame->frame_format))
+    return;
+
+  if ((frame->width | frame->height) & 1) {
+    ROS_WARN_ONCE("H.264 needs even frame sizes; not encoding %dx%d frames",
+                  frame->width, frame->height);
+    return;
+  }
+
+  size_t bytes = (size_t) frame->width * frame->height * 2;
+  if (frame->data_bytes < bytes)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (has_pending_) {
+      ++drops_;
+      ROS_WARN_THROTTLE(10, "H.264 encoder can't keep up, skipped %lu frames so far", drops_);
+      // Don't lose a requested keyframe along with the skipped frame.
+      force_keyframe = force_keyframe || pending_.force_keyframe;
+    }
+    pending_.data.assign(static_cast<uint8_t*>(frame->data),
+                         static_cast<uint8_t*>(frame->data) + bytes);
+    pending_.format = frame->frame_format;
+    pending_.width = frame->width;
+    pending_.height = frame->height;
+    pending_.frame_rate = frame_rate > 0.0 ? frame_rate : 30.0;
+    pending_.frame_id = frame_id;
+    pending_.stamp = stamp;
+    pending_.force_keyframe = force_keyframe;
+    has_pending_ = true;
+  }
+  pending_cond_.notify_one();
+}
+
+void H264Encoder::SetMaxFrameAge(double seconds) {
+  boost::mutex::scoped_lock lock(mutex_);
+  max_frame_age_ = seconds;
+}
+
+void H264Encoder::EncodeLoop() {
+  for (;;) {
+    double max_frame_age;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (!has_pending_ && !stop_)
+        pending_cond_.wait(lock);
+      if (stop_)
+        break;
+      // Swap so the buffers are reused rather than reallocated.
+      std::swap(current_, pending_);
+      has_pending_ = false;
+      max_frame_age = max_frame_age_;
+    }
+
+    if (max_frame_age > 0.0 && (ros::Time::now() - current_.stamp).toSec() > max_frame_age) {
+      ++stale_drops_;
+      ROS_WARN_THROTTLE(10, "H.264 encoder skipped %lu stale frames so far", stale_drops_);
+      force_next_keyframe_ = force_next_keyframe_ || current_.force_keyframe;
+      continue;
+    }
+
+    Encode(current_);
+  }
+
+  CloseEncoder();
+}
+
+bool H264Encoder::OpenEncoder(int width, int height, double frame_rate) {
+#ifdef LIBUVC_CAMERA_HAVE_X264
+  CloseEncoder();
+
+  x264_param_t param;
+  if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0)
+    return false;
+
+  param.i_width = width;
+  param.i_height = height;
+  param.i_csp = X264_CSP_I420;
+  param.i_threads = options_.threads;
+  param.i_fps_num = (uint32_t) (frame_rate * 1000 + 0.5);
+  param.i_fps_den = 1000;
+  param.i_keyint_max = options_.keyframe_interval;
+  param.b_intra_refresh = 0;
+  param.b_repeat_headers = 1;
+  param.b_annexb = 1;
+  param.rc.i_rc_method = X264_RC_ABR;
+  param.rc.i_bitrate = options_.bitrate_kbps;
+  param.rc.i_vbv_max_bitrate = options_.bitrate_kbps;
+  param.rc.i_vbv_buffer_size = options_.bitrate_kbps;
+
+  if (x264_param_apply_profile(&param, "baseline") < 0)
+    return false;
+
+  x264_t *encoder = x264_encoder_open(&param);
+  if (!encoder) {
+    ROS_WARN("Couldn't open H.264 encoder for %dx%d", width, height);
+    return false;
+  }
+
+  // Input planes are reused for every frame of this size.
+  x264_picture_t *picture = new x264_picture_t;
+  if (x264_picture_alloc(picture, X264_CSP_I420, width, height) < 0) {
+    delete picture;
+    x264_encoder_close(encoder);
+    return false;
+  }
+
+  encoder_ = encoder;
+  picture_ = picture;
+  encoder_width_ = width;
+  encoder_height_ = height;
+  encoder_frame_rate_ = frame_rate;
+  pts_ = 0;
+  ROS_INFO("H.264 encoder: %dx%d at %.1f fps, %d kbit/s, keyframe every %d frames",
+           width, height, frame_rate, options_.bitrate_kbps, options_.keyframe_interval);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void H264Encoder::CloseEncoder() {
+#ifdef LIBUVC_CAMERA_HAVE_X264
+  if (encoder_)
+    x264_encoder_close(static_cast<x264_t*>(encoder_));
+  if (picture_) {
+    x264_picture_clean(static_cast<x264_picture_t*>(picture_));
+    delete static_cast<x264_picture_t*>(picture_);
+  }
+#endif
+  encoder_ = NULL;
+  picture_ = NULL;
+}
+
+void H264Encoder::Encode(const Input &input) {
+#ifdef LIBUVC_CAMERA_HAVE_X264
+  if (!encoder_ || input.width != encoder_width_ || input.height != encoder_height_ ||
+      input.frame_rate != encoder_frame_rate_) {
+    if (!OpenEncoder(input.width, input.height, input.frame_rate))
+      return;
+  }
+
+  x264_picture_t &picture = *static_cast<x264_picture_t*>(picture_);
+  if (input.format == UVC_FRAME_FORMAT_YUYV)
+    PackedToI420(&input.data[0], input.width, input.height, 0, 1, 3, picture.img);
+  else
+    PackedToI420(&input.data[0], input.width, input.height, 1, 0, 2, picture.img);
+
+  picture.i_pts = pts_++;
+  picture.i_type = input.force_keyframe || force_next_keyframe_ ? X264_TYPE_IDR : X264_TYPE_AUTO;
+  force_next_keyframe_ = false;
+
+  x264_nal_t *nals;
+  int num_nals;
+  x264_picture_t picture_out;
+  int bytes = x264_encoder_encode(static_cast<x264_t*>(encoder_), &nals, &num_nals,
+                                  &picture, &picture_out);
+
+  if (bytes < 0) {
+    ROS_WARN_THROTTLE(10, "H.264 encoding failed");
+    return;
+  }
+  if (bytes == 0)
+    return;
+
+  // The NAL units of one frame are contiguous in x264's output buffer.
+  sensor_msgs::CompressedImage::Ptr packet(new sensor_msgs::CompressedImage());
+  packet->header.frame_id = input.frame_id;
+  packet->header.stamp = input.stamp;
+  packet->format = "h264";
+  packet->data.assign(nals[0].p_payload, nals[0].p_payload + bytes);
+
+  callback_(packet);
+#endif
+}
+
+};
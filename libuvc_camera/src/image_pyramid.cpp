@@ -0,0 +1,114 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/image_pyramid.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace libuvc_camera {
+
+namespace {
+
+// Output pixels [begin, end) of one row pair, for any channel count.
+void HalveRowScalar(const uint8_t *top, const uint8_t *bottom, uint8_t *dst,
+                    int begin, int end, int channels) {
+  for (int x = begin; x < end; ++x) {
+    for (int c = 0; c < channels; ++c) {
+      int left = 2 * x * channels + c;
+      dst[x * channels + c] = (top[left] + top[left + channels] +
+                               bottom[left] + bottom[left + channels] + 2) >> 2;
+    }
+  }
+}
+
+#ifdef __SSE2__
+// 16 input bytes from each row become 8 output bytes; returns the first
+// output pixel left for the scalar tail.
+int HalveRowSse2(const uint8_t *top, const uint8_t *bottom, uint8_t *dst,
+                 int out_width, int channels) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  int pixels_per_step = 8 / channels;
+
+  int x = 0;
+  for (; x + pixels_per_step <= out_width; x += pixels_per_step) {
+    const __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + x * 2 * channels));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + x * 2 * channels));
+
+    __m128i sum;
+    if (channels == 1) {
+      // Neighbours are adjacent bytes: add the even and odd bytes as words.
+      const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+      sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(t, low_bytes), _mm_srli_epi16(t, 8)),
+                          _mm_add_epi16(_mm_and_si128(b, low_bytes), _mm_srli_epi16(b, 8)));
+    } else {
+      // Neighbours are 4 bytes apart: each 64-bit half of the widened rows
+      // holds a pixel pair.
+      const __m128i vertical_lo = _mm_add_epi16(_mm_unpacklo_epi8(t, zero),
+                                                _mm_unpacklo_epi8(b, zero));
+      const __m128i vertical_hi = _mm_add_epi16(_mm_unpackhi_epi8(t, zero),
+                                                _mm_unpackhi_epi8(b, zero));
+      sum = _mm_add_epi16(_mm_unpacklo_epi64(vertical_lo, vertical_hi),
+                          _mm_unpackhi_epi64(vertical_lo, vertical_hi));
+    }
+
+    const __m128i mean = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x * channels),
+                     _mm_packus_epi16(mean, zero));
+  }
+  return x;
+}
+#endif
+
+}
+
+void HalveImage(const uint8_t *src, size_t src_step, int width, int height,
+                int channels, uint8_t *dst, size_t dst_step) {
+  int out_width = width / 2;
+  int out_height = height / 2;
+  for (int y = 0; y < out_height; ++y, dst += dst_step) {
+    const uint8_t *top = src + 2 * y * src_step;
+    const uint8_t *bottom = top + src_step;
+
+    int x = 0;
+#ifdef __SSE2__
+    if (channels == 1 || channels == 4)
+      x = HalveRowSse2(top, bottom, dst, out_width, channels);
+#endif
+    HalveRowScalar(top, bottom, dst, x, out_width, channels);
+  }
+}
+
+};
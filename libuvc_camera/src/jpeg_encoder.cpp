@@ -0,0 +1,296 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/jpeg_encoder.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+#include <jpeglib.h>
+#endif
+
+namespace libuvc_camera {
+
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+namespace {
+
+// Collects the DCTSIZE rows of 4:2:2 planes that jpeg_write_raw_data
+// consumes per call, padded out to whole MCUs.
+struct RawRows {
+  std::vector<uint8_t> luma, cb, cr;
+  std::vector<JSAMPROW> luma_rows, cb_rows, cr_rows;
+  JSAMPARRAY planes[3];
+
+  RawRows(int padded_width)
+    : luma(padded_width * DCTSIZE), cb(padded_width / 2 * DCTSIZE), cr(padded_width / 2 * DCTSIZE),
+      luma_rows(DCTSIZE), cb_rows(DCTSIZE), cr_rows(DCTSIZE) {
+    for (int i = 0; i < DCTSIZE; ++i) {
+      luma_rows[i] = &luma[i * padded_width];
+      cb_rows[i] = &cb[i * padded_width / 2];
+      cr_rows[i] = &cr[i * padded_width / 2];
+    }
+    planes[0] = &luma_rows[0];
+    planes[1] = &cb_rows[0];
+    planes[2] = &cr_rows[0];
+  }
+};
+
+// Turns libjpeg's fatal errors, which would otherwise exit() the node, into
+// a longjmp back to Compress.
+struct ErrorManager {
+  struct jpeg_error_mgr base;
+  jmp_buf jump;
+};
+
+void ErrorExit(j_common_ptr info) {
+  ErrorManager *error = reinterpret_cast<ErrorManager*>(info->err);
+  char message[JMSG_LENGTH_MAX];
+  (*info->err->format_message)(info, message);
+  ROS_WARN_THROTTLE(10, "JPEG encoding failed: %s", message);
+  longjmp(error->jump, 1);
+}
+
+}
+#endif
+
+JpegEncoder::JpegEncoder()
+  : quality_(80), running_(false), has_pending_(false), stop_(false), drops_(0),
+    max_frame_age_(0.0), stale_drops_(0) {
+}
+
+JpegEncoder::~JpegEncoder() {
+  Stop();
+}
+
+bool JpegEncoder::Supported() {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool JpegEncoder::Start(int quality, const PacketCallback &callback) {
+  Stop();
+
+  if (!Supported()) {
+    ROS_WARN("JPEG output requested, but this build has no libjpeg");
+    return false;
+  }
+
+  quality_ = quality;
+  callback_ = callback;
+  has_pending_ = false;
+  stop_ = false;
+  drops_ = 0;
+  stale_drops_ = 0;
+  running_ = true;
+  thread_ = boost::thread(&JpegEncoder::EncodeLoop, this);
+  return true;
+}
+
+void JpegEncoder::Stop() {
+  if (!running_)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+  pending_cond_.notify_all();
+  thread_.join();
+  running_ = false;
+}
+
+void JpegEncoder::Submit(uvc_frame_t *frame, const std::string &frame_id, ros::Time stamp) {
+  if (!running_ || !CanEncode(frame->frame_format))
+    return;
+
+  size_t bytes = (size_t) frame->width * frame->height * 2;
+  if (frame->data_bytes < bytes)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (has_pending_) {
+      ++drops_;
+      ROS_WARN_THROTTLE(10, "JPEG encoder can't keep up, skipped %lu frames so far", drops_);
+    }
+    pending_.data.assign(static_cast<uint8_t*>(frame->data),
+                         static_cast<uint8_t*>(frame->data) + bytes);
+    pending_.format = frame->frame_format;
+    pending_.width = frame->width;
+    pending_.height = frame->height;
+    pending_.frame_id = frame_id;
+    pending_.stamp = stamp;
+    has_pending_ = true;
+  }
+  pending_cond_.notify_one();
+}
+
+void JpegEncoder::SetMaxFrameAge(double seconds) {
+  boost::mutex::scoped_lock lock(mutex_);
+  max_frame_age_ = seconds;
+}
+
+void JpegEncoder::EncodeLoop() {
+  for (;;) {
+    double max_frame_age;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (!has_pending_ && !stop_)
+        pending_cond_.wait(lock);
+      if (stop_)
+        break;
+      std::swap(current_, pending_);
+      has_pending_ = false;
+      max_frame_age = max_frame_age_;
+    }
+
+    if (max_frame_age > 0.0 && (ros::Time::now() - current_.stamp).toSec() > max_frame_age) {
+      ++stale_drops_;
+      ROS_WARN_THROTTLE(10, "JPEG encoder skipped %lu stale frames so far", stale_drops_);
+      continue;
+    }
+
+    sensor_msgs::CompressedImage::Ptr packet(new sensor_msgs::CompressedImage());
+    if (!Compress(&current_.data[0], current_.format, current_.width, current_.height,
+                  quality_, &packet->data)) {
+      ROS_WARN_THROTTLE(10, "JPEG encoding failed");
+      continue;
+    }
+
+    packet->header.frame_id = current_.frame_id;
+    packet->header.stamp = current_.stamp;
+    packet->format = "bgr8; jpeg compressed bgr8";
+    callback_(packet);
+  }
+}
+
+/* static */ bool JpegEncoder::Compress(const uint8_t *src, enum uvc_frame_format format,
+                                        int width, int height, int quality,
+                                        std::vector<uint8_t> *jpeg) {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  if (width < 2 || height < 1 || (width & 1))
+    return false;
+
+  // Byte offsets of Y0, Cb, Y1 and Cr within each 4-byte group
+  int y_offset = format == UVC_FRAME_FORMAT_UYVY ? 1 : 0;
+  int cb_offset = format == UVC_FRAME_FORMAT_UYVY ? 0 : 1;
+  int cr_offset = cb_offset + 2;
+
+  // Everything that must be released on an error exists before the setjmp.
+  int padded_width = (width + 2 * DCTSIZE - 1) / (2 * DCTSIZE) * (2 * DCTSIZE);
+  RawRows rows(padded_width);
+  size_t src_step = width * 2;
+
+  struct jpeg_compress_struct cinfo;
+  ErrorManager error;
+  cinfo.err = jpeg_std_error(&error.base);
+  error.base.error_exit = ErrorExit;
+  jpeg_create_compress(&cinfo);
+
+  unsigned char *out = NULL;
+  unsigned long out_size = 0;
+
+  if (setjmp(error.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    free(out);
+    return false;
+  }
+
+  jpeg_mem_dest(&cinfo, &out, &out_size);
+
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.raw_data_in = TRUE;
+  cinfo.dct_method = JDCT_IFAST;
+
+  // 4:2:2: luma is 2x1 blocks per MCU, chroma 1x1.
+  cinfo.comp_info[0].h_samp_factor = 2;
+  cinfo.comp_info[0].v_samp_factor = 1;
+  cinfo.comp_info[1].h_samp_factor = 1;
+  cinfo.comp_info[1].v_samp_factor = 1;
+  cinfo.comp_info[2].h_samp_factor = 1;
+  cinfo.comp_info[2].v_samp_factor = 1;
+
+  jpeg_start_compress(&cinfo, TRUE);
+
+  while (cinfo.next_scanline < cinfo.image_height) {
+    for (int i = 0; i < DCTSIZE; ++i) {
+      // Past the bottom, repeat the last row to fill the MCU.
+      int y = std::min((int) cinfo.next_scanline + i, height - 1);
+      const uint8_t *in = src + y * src_step;
+      uint8_t *luma = rows.luma_rows[i];
+      uint8_t *cb = rows.cb_rows[i];
+      uint8_t *cr = rows.cr_rows[i];
+
+      int x = 0;
+      for (; x < width; x += 2, in += 4) {
+        luma[x] = in[y_offset];
+        luma[x + 1] = in[y_offset + 2];
+        cb[x / 2] = in[cb_offset];
+        cr[x / 2] = in[cr_offset];
+      }
+      // And the last column to the right.
+      for (; x < padded_width; x += 2) {
+        luma[x] = luma[x + 1] = luma[width - 1];
+        cb[x / 2] = cb[width / 2 - 1];
+        cr[x / 2] = cr[width / 2 - 1];
+      }
+    }
+
+    jpeg_write_raw_data(&cinfo, rows.planes, DCTSIZE);
+  }
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  jpeg->assign(out, out + out_size);
+  free(out);
+  return true;
+#else
+  return false;
+#endif
+}
+
+};
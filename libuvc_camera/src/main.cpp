@@ -32,20 +32,44 @@
 *  POSSIBILITY OF SUCH DAMAGE.
 *********************************************************************/
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 
 #include "libuvc_camera/camera_driver.h"
 
 int main (int argc, char **argv) {
   ros::init(argc, argv, "libuvc_camera");
+
+  // Control services (dynamic_reconfigure, set_camera_info) and publisher
+  // bookkeeping (subscriber connects/disconnects) are served from separate
+  // queues so that a slow calibration upload can't stall either of them.
+  ros::CallbackQueue publisher_queue;
+  ros::CallbackQueue control_queue;
+
   ros::NodeHandle nh;
+  nh.setCallbackQueue(&publisher_queue);
   ros::NodeHandle priv_nh("~");
+  priv_nh.setCallbackQueue(&control_queue);
+
+  // Two threads by default so reconfigure and set_camera_info run side by side.
+  int control_threads;
+  priv_nh.param("control_threads", control_threads, 2);
+  if (control_threads < 1)
+    control_threads = 1;
 
   libuvc_camera::CameraDriver driver(nh, priv_nh);
 
   if (!driver.Start())
     return -1;
 
-  ros::spin();
+  ros::AsyncSpinner publisher_spinner(1, &publisher_queue);
+  ros::AsyncSpinner control_spinner(control_threads, &control_queue);
+  publisher_spinner.start();
+  control_spinner.start();
+
+  ros::waitForShutdown();
+
+  control_spinner.stop();
+  publisher_spinner.stop();
 
   driver.Stop();
 
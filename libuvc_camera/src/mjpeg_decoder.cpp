@@ -0,0 +1,358 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/mjpeg_decoder.h"
+#include "libuvc_camera/color_conversion.h"
+
+#include <ros/ros.h>
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+#include <jpeglib.h>
+#endif
+
+namespace libuvc_camera {
+
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+namespace {
+
+// The standard tables (JPEG spec K.3) that MJPEG frames leave out
+const UINT8 kDcLuminanceBits[17] = {0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+const UINT8 kDcChrominanceBits[17] = {0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+const UINT8 kDcValues[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+const UINT8 kAcLuminanceBits[17] = {0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+const UINT8 kAcLuminanceValues[162] = {
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+  0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+  0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+  0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+  0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+  0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+  0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+  0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+  0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+  0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+  0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+const UINT8 kAcChrominanceBits[17] = {0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+const UINT8 kAcChrominanceValues[162] = {
+  0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+  0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+  0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+  0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+  0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+  0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+  0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+  0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+  0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+  0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+  0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+void SetHuffmanTable(j_decompress_ptr dinfo, JHUFF_TBL **table,
+                     const UINT8 *bits, const UINT8 *values, size_t num_values) {
+  if (!*table)
+    *table = jpeg_alloc_huff_table((j_common_ptr) dinfo);
+  memcpy((*table)->bits, bits, sizeof((*table)->bits));
+  memcpy((*table)->huffval, values, num_values);
+}
+
+// Installs the standard tables. They live in libjpeg's permanent pool, so
+// they stay in place from frame to frame; a frame with its own DHT segment
+// replaces them from then on.
+void InstallHuffmanTables(j_decompress_ptr dinfo) {
+  SetHuffmanTable(dinfo, &dinfo->dc_huff_tbl_ptrs[0], kDcLuminanceBits,
+                  kDcValues, sizeof(kDcValues));
+  SetHuffmanTable(dinfo, &dinfo->ac_huff_tbl_ptrs[0], kAcLuminanceBits,
+                  kAcLuminanceValues, sizeof(kAcLuminanceValues));
+  SetHuffmanTable(dinfo, &dinfo->dc_huff_tbl_ptrs[1], kDcChrominanceBits,
+                  kDcValues, sizeof(kDcValues));
+  SetHuffmanTable(dinfo, &dinfo->ac_huff_tbl_ptrs[1], kAcChrominanceBits,
+                  kAcChrominanceValues, sizeof(kAcChrominanceValues));
+}
+
+struct ErrorManager {
+  struct jpeg_error_mgr base;
+  jmp_buf jump;
+};
+
+void ErrorExit(j_common_ptr info) {
+  ErrorManager *error = reinterpret_cast<ErrorManager*>(info->err);
+  char message[JMSG_LENGTH_MAX];
+  (*info->err->format_message)(info, message);
+  ROS_WARN_THROTTLE(10, "MJPEG decoding failed: %s", message);
+  longjmp(error->jump, 1);
+}
+
+// Corrupt-data warnings are routine on lossy USB links; don't print them.
+void EmitMessage(j_common_ptr info, int level) {
+}
+
+}
+
+struct MjpegDecoder::State {
+  struct jpeg_decompress_struct dinfo;
+  ErrorManager error;
+
+  // Output rows handed to jpeg_read_scanlines
+  std::vector<JSAMPROW> output_rows;
+
+  // Raw data output: one iMCU row of each component
+  std::vector<uint8_t> planes[3];
+  std::vector<JSAMPROW> rows[3];
+  JSAMPARRAY plane_rows[3];
+};
+#else
+struct MjpegDecoder::State {
+};
+#endif
+
+MjpegDecoder::MjpegDecoder()
+  : state_(new State()) {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  state_->dinfo.err = jpeg_std_error(&state_->error.base);
+  state_->error.base.error_exit = ErrorExit;
+  state_->error.base.emit_message = EmitMessage;
+  jpeg_create_decompress(&state_->dinfo);
+  InstallHuffmanTables(&state_->dinfo);
+#endif
+}
+
+MjpegDecoder::~MjpegDecoder() {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  jpeg_destroy_decompress(&state_->dinfo);
+#endif
+  delete state_;
+}
+
+bool MjpegDecoder::Supported() {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool MjpegDecoder::DecodeYuv422(const uint8_t *jpeg, size_t jpeg_bytes,
+                                int width, int height, uint8_t *dst, size_t dst_step) {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  j_decompress_ptr dinfo = &state_->dinfo;
+
+  if (setjmp(state_->error.jump)) {
+    jpeg_abort_decompress(dinfo);
+    return false;
+  }
+
+  jpeg_mem_src(dinfo, const_cast<uint8_t*>(jpeg), jpeg_bytes);
+  jpeg_read_header(dinfo, TRUE);
+
+  const jpeg_component_info *comp = dinfo->comp_info;
+  if ((int) dinfo->image_width != width || (int) dinfo->image_height != height ||
+      dinfo->num_components != 3 || dinfo->jpeg_color_space != JCS_YCbCr ||
+      comp[0].h_samp_factor != 2 || comp[0].v_samp_factor > 2 ||
+      comp[1].h_samp_factor != 1 || comp[1].v_samp_factor != 1 ||
+      comp[2].h_samp_factor != 1 || comp[2].v_samp_factor != 1) {
+    ROS_WARN_THROTTLE(10, "Can't decode %dx%d MJPEG with this sampling to yuv422",
+                      dinfo->image_width, dinfo->image_height);
+    jpeg_abort_decompress(dinfo);
+    return false;
+  }
+
+  dinfo->raw_data_out = TRUE;
+  dinfo->do_fancy_upsampling = FALSE;
+  dinfo->dct_method = JDCT_IFAST;
+  jpeg_start_decompress(dinfo);
+
+  // Luma rows per iMCU row; chroma has DCTSIZE
+  int luma_rows = comp[0].v_samp_factor * DCTSIZE;
+  for (int c = 0; c < 3; ++c) {
+    int rows = comp[c].v_samp_factor * DCTSIZE;
+    size_t stride = comp[c].width_in_blocks * DCTSIZE;
+    state_->planes[c].resize(rows * stride);
+    state_->rows[c].resize(rows);
+    for (int r = 0; r < rows; ++r)
+      state_->rows[c][r] = &state_->planes[c][r * stride];
+    state_->plane_rows[c] = &state_->rows[c][0];
+  }
+
+  while (dinfo->output_scanline < dinfo->output_height) {
+    int top = dinfo->output_scanline;
+    jpeg_read_raw_data(dinfo, state_->plane_rows, luma_rows);
+
+    int rows = std::min(luma_rows, height - top);
+    for (int r = 0; r < rows; ++r) {
+      const uint8_t *luma = state_->rows[0][r];
+      const uint8_t *cb = state_->rows[1][r / comp[0].v_samp_factor];
+      const uint8_t *cr = state_->rows[2][r / comp[0].v_samp_factor];
+      uint8_t *out = dst + (top + r) * dst_step;
+      for (int x = 0; x + 1 < width; x += 2, out += 4) {
+        out[0] = cb[x / 2];
+        out[1] = luma[x];
+        out[2] = cr[x / 2];
+        out[3] = luma[x + 1];
+      }
+    }
+  }
+
+  jpeg_finish_decompress(dinfo);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool MjpegDecoder::DecodeMono8(const uint8_t *jpeg, size_t jpeg_bytes,
+                               int width, int height, uint8_t *dst, size_t dst_step) {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  // With a grayscale output libjpeg marks the chroma components as not
+  // needed, skipping their IDCT and upsampling.
+  return DecodeScanlines(jpeg, jpeg_bytes, width, height, JCS_GRAYSCALE, dst, dst_step);
+#else
+  return false;
+#endif
+}
+
+bool MjpegDecoder::DecodeRgb8(const uint8_t *jpeg, size_t jpeg_bytes,
+                              int width, int height, uint8_t *dst, size_t dst_step) {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  return DecodeScanlines(jpeg, jpeg_bytes, width, height, JCS_RGB, dst, dst_step);
+#else
+  return false;
+#endif
+}
+
+bool MjpegDecoder::DecodeBgra8(const uint8_t *jpeg, size_t jpeg_bytes,
+                               int width, int height, bool swap_red_blue,
+                               uint8_t *dst, size_t dst_step) {
+#if defined(LIBUVC_CAMERA_HAVE_JPEG) && defined(JCS_ALPHA_EXTENSIONS)
+  return DecodeScanlines(jpeg, jpeg_bytes, width, height,
+                         swap_red_blue ? JCS_EXT_RGBA : JCS_EXT_BGRA, dst, dst_step);
+#elif defined(LIBUVC_CAMERA_HAVE_JPEG)
+  if (!DecodeScanlines(jpeg, jpeg_bytes, width, height, JCS_RGB, dst, dst_step))
+    return false;
+  ExpandToFourChannels(dst, dst_step, dst, dst_step, width, height, !swap_red_blue);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool MjpegDecoder::DecodeLumaThumbnail(const uint8_t *jpeg, size_t jpeg_bytes,
+                                       std::vector<uint8_t> *luma, int *width, int *height) {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  j_decompress_ptr dinfo = &state_->dinfo;
+
+  if (setjmp(state_->error.jump)) {
+    jpeg_abort_decompress(dinfo);
+    return false;
+  }
+
+  jpeg_mem_src(dinfo, const_cast<uint8_t*>(jpeg), jpeg_bytes);
+  jpeg_read_header(dinfo, TRUE);
+
+  dinfo->out_color_space = JCS_GRAYSCALE;
+  dinfo->scale_num = 1;
+  dinfo->scale_denom = 8;
+  dinfo->dct_method = JDCT_IFAST;
+  jpeg_start_decompress(dinfo);
+
+  *width = dinfo->output_width;
+  *height = dinfo->output_height;
+  luma->resize((size_t) *width * *height);
+  while (dinfo->output_scanline < dinfo->output_height) {
+    JSAMPROW row = &(*luma)[dinfo->output_scanline * *width];
+    jpeg_read_scanlines(dinfo, &row, 1);
+  }
+
+  jpeg_finish_decompress(dinfo);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool MjpegDecoder::DecodeScanlines(const uint8_t *jpeg, size_t jpeg_bytes,
+                                   int width, int height, int color_space,
+                                   uint8_t *dst, size_t dst_step) {
+#ifdef LIBUVC_CAMERA_HAVE_JPEG
+  j_decompress_ptr dinfo = &state_->dinfo;
+
+  if (setjmp(state_->error.jump)) {
+    jpeg_abort_decompress(dinfo);
+    return false;
+  }
+
+  jpeg_mem_src(dinfo, const_cast<uint8_t*>(jpeg), jpeg_bytes);
+  jpeg_read_header(dinfo, TRUE);
+
+  if ((int) dinfo->image_width != width || (int) dinfo->image_height != height) {
+    ROS_WARN_THROTTLE(10, "MJPEG frame is %dx%d, expected %dx%d",
+                      dinfo->image_width, dinfo->image_height, width, height);
+    jpeg_abort_decompress(dinfo);
+    return false;
+  }
+
+  dinfo->out_color_space = (J_COLOR_SPACE) color_space;
+  dinfo->dct_method = JDCT_IFAST;
+  jpeg_start_decompress(dinfo);
+
+  // Scanlines go straight into the caller's image.
+  state_->output_rows.resize(height);
+  for (int y = 0; y < height; ++y)
+    state_->output_rows[y] = dst + y * dst_step;
+
+  while (dinfo->output_scanline < dinfo->output_height) {
+    jpeg_read_scanlines(dinfo, &state_->output_rows[dinfo->output_scanline],
+                        dinfo->output_height - dinfo->output_scanline);
+  }
+
+  jpeg_finish_decompress(dinfo);
+  return true;
+#else
+  return false;
+#endif
+}
+};
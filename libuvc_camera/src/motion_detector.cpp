@@ -0,0 +1,73 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/motion_detector.h"
+
+#include <stdlib.h>
+
+namespace libuvc_camera {
+
+MotionDetector::MotionDetector()
+  : current_(kGridWidth * kGridHeight) {
+}
+
+void MotionDetector::Sample(const uint8_t *luma, size_t pixel_stride, size_t row_stride,
+                            int width, int height) {
+  // Centre of each grid cell
+  for (int gy = 0; gy < kGridHeight; ++gy) {
+    const uint8_t *row = luma + ((2 * gy + 1) * height / (2 * kGridHeight)) * row_stride;
+    uint8_t *out = &current_[gy * kGridWidth];
+    for (int gx = 0; gx < kGridWidth; ++gx)
+      out[gx] = row[((2 * gx + 1) * width / (2 * kGridWidth)) * pixel_stride];
+  }
+}
+
+double MotionDetector::Difference() const {
+  if (reference_.empty())
+    return -1.0;
+
+  unsigned sum = 0;
+  for (size_t i = 0; i < current_.size(); ++i)
+    sum += abs((int) current_[i] - (int) reference_[i]);
+  return (double) sum / current_.size();
+}
+
+void MotionDetector::Accept() {
+  reference_ = current_;
+}
+
+void MotionDetector::Reset() {
+  reference_.clear();
+}
+
+};
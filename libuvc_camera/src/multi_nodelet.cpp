@@ -0,0 +1,162 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <pluginlib/class_list_macros.h>
+#include <nodelet/nodelet.h>
+#include <boost/thread/thread.hpp>
+
+#include "libuvc_camera/camera_driver.h"
+
+namespace libuvc_camera {
+
+// Runs several cameras from one nodelet over a shared libuvc context.
+// ~cameras lists the camera names; each camera is configured from the
+// ~<name> private namespace and publishes under <name>. Unless a camera sets
+// ~<name>/use_decode_pool false, all of them convert on the shared decode
+// pool rather than on their own libuvc threads.
+class MultiCameraNodelet : public nodelet::Nodelet {
+public:
+  MultiCameraNodelet() : ctx_(NULL) {}
+  ~MultiCameraNodelet();
+
+private:
+  struct Camera {
+    std::string name;
+    boost::shared_ptr<CameraDriver> driver;
+    bool running;
+    ros::WallDuration startup_time;
+  };
+
+  virtual void onInit();
+  void StartCamera(Camera *camera);
+
+  uvc_context_t *ctx_;
+  std::vector<Camera> cameras_;
+  ros::CallbackQueue control_queue_;
+  boost::shared_ptr<ros::AsyncSpinner> control_spinner_;
+};
+
+MultiCameraNodelet::~MultiCameraNodelet() {
+  if (control_spinner_)
+    control_spinner_->stop();
+
+  for (size_t i = 0; i < cameras_.size(); ++i) {
+    if (cameras_[i].running)
+      cameras_[i].driver->Stop();
+  }
+  cameras_.clear();
+
+  if (ctx_)
+    uvc_exit(ctx_);
+}
+
+void MultiCameraNodelet::StartCamera(Camera *camera) {
+  ros::WallTime start = ros::WallTime::now();
+  camera->running = camera->driver->Start(ctx_);
+  camera->startup_time = ros::WallTime::now() - start;
+
+  if (camera->running) {
+    NODELET_INFO("Camera %s streaming after %.1f ms",
+                 camera->name.c_str(), camera->startup_time.toSec() * 1000.0);
+  } else {
+    NODELET_ERROR("Unable to open camera %s.", camera->name.c_str());
+  }
+}
+
+void MultiCameraNodelet::onInit() {
+  ros::NodeHandle nh(getNodeHandle());
+  ros::NodeHandle priv_nh(getPrivateNodeHandle());
+
+  std::vector<std::string> names;
+  if (!priv_nh.getParam("cameras", names) || names.empty()) {
+    NODELET_ERROR("No cameras configured; set ~cameras to a list of camera names.");
+    return;
+  }
+
+  int control_threads;
+  priv_nh.param("control_threads", control_threads, 2);
+  if (control_threads < 1)
+    control_threads = 1;
+
+  uvc_error_t err = uvc_init(&ctx_, NULL);
+  if (err != UVC_SUCCESS) {
+    NODELET_ERROR("uvc_init: %s", uvc_strerror(err));
+    ctx_ = NULL;
+    return;
+  }
+
+  cameras_.resize(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    ros::NodeHandle camera_nh(nh, names[i]);
+    ros::NodeHandle camera_priv_nh(priv_nh, names[i]);
+    camera_priv_nh.setCallbackQueue(&control_queue_);
+
+    cameras_[i].name = names[i];
+    cameras_[i].running = false;
+    cameras_[i].driver.reset(new CameraDriver(camera_nh, camera_priv_nh, true));
+  }
+
+  // Device lookup, negotiation and control setup run concurrently; each
+  // camera starts publishing as soon as its own startup completes.
+  ros::WallTime start = ros::WallTime::now();
+  boost::thread_group startup_threads;
+  for (size_t i = 0; i < cameras_.size(); ++i)
+    startup_threads.create_thread(
+      boost::bind(&MultiCameraNodelet::StartCamera, this, &cameras_[i]));
+  startup_threads.join_all();
+  ros::WallDuration total_time = ros::WallTime::now() - start;
+
+  int num_running = 0;
+  NODELET_INFO("Camera startup report:");
+  for (size_t i = 0; i < cameras_.size(); ++i) {
+    NODELET_INFO("  %-20s %-8s %8.1f ms", cameras_[i].name.c_str(),
+                 cameras_[i].running ? "ok" : "FAILED",
+                 cameras_[i].startup_time.toSec() * 1000.0);
+    if (cameras_[i].running)
+      ++num_running;
+    else
+      cameras_[i].driver.reset();
+  }
+  NODELET_INFO("  %d of %d cameras running after %.1f ms", num_running,
+               (int) cameras_.size(), total_time.toSec() * 1000.0);
+
+  control_spinner_.reset(new ros::AsyncSpinner(control_threads, &control_queue_));
+  control_spinner_->start();
+}
+
+};
+
+PLUGINLIB_DECLARE_CLASS(libuvc_camera, multi_driver,
+                        libuvc_camera::MultiCameraNodelet, nodelet::Nodelet);
@@ -32,6 +32,7 @@
 *  POSSIBILITY OF SUCH DAMAGE.
 *********************************************************************/
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <pluginlib/class_list_macros.h>
 #include <nodelet/nodelet.h>
 
@@ -48,22 +49,39 @@ private:
   virtual void onInit();
 
   volatile bool running_;
+  // Reconfigure and camera info services are served from this queue by our
+  // own spinner rather than by the manager's shared worker threads.
+  ros::CallbackQueue control_queue_;
+  boost::shared_ptr<ros::AsyncSpinner> control_spinner_;
   boost::shared_ptr<CameraDriver> driver_;
 };
 
 CameraNodelet::~CameraNodelet() {
+  if (control_spinner_)
+    control_spinner_->stop();
+
   if (running_) {
     driver_->Stop();
   }
 }
 
 void CameraNodelet::onInit() {
+  // Images are published as shared pointers on the manager's handle, so
+  // subscribers in the same manager receive them without a copy.
   ros::NodeHandle nh(getNodeHandle());
   ros::NodeHandle priv_nh(getPrivateNodeHandle());
+  priv_nh.setCallbackQueue(&control_queue_);
+
+  int control_threads;
+  priv_nh.param("control_threads", control_threads, 2);
+  if (control_threads < 1)
+    control_threads = 1;
 
   driver_.reset(new CameraDriver(nh, priv_nh));
   if (driver_->Start()) {
     running_ = true;
+    control_spinner_.reset(new ros::AsyncSpinner(control_threads, &control_queue_));
+    control_spinner_->start();
   } else {
     NODELET_ERROR("Unable to open camera.");
     driver_.reset();
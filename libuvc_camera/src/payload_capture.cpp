@@ -0,0 +1,354 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/payload_capture.h"
+
+#include <ros/ros.h>
+#include <boost/bind.hpp>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace libuvc_camera {
+
+namespace {
+
+// usbmon binary interface, from Documentation/usb/usbmon.rst. The kernel
+// doesn't export these in a uapi header.
+struct usbmon_packet {
+  uint64_t id;
+  unsigned char type;       // 'S'ubmission, 'C'allback, 'E'rror
+  unsigned char xfer_type;  // ISO (0), Intr, Control, Bulk (3)
+  unsigned char epnum;      // Endpoint number; 0x80 IN
+  unsigned char devnum;
+  uint16_t busnum;
+  char flag_setup;
+  char flag_data;
+  int64_t ts_sec;
+  int32_t ts_usec;
+  int32_t status;
+  uint32_t length;          // Length of data (submitted or actual)
+  uint32_t len_cap;         // Delivered length, including ISO descriptors
+  union {
+    unsigned char setup[8];
+    struct {
+      int32_t error_count;
+      int32_t numdesc;
+    } iso;
+  } s;
+  int32_t interval;
+  int32_t start_frame;
+  uint32_t xfer_flags;
+  uint32_t ndesc;           // Number of ISO descriptors preceding the data
+};
+
+struct usbmon_isodesc {
+  int32_t iso_status;
+  uint32_t iso_off;
+  uint32_t iso_len;
+  uint32_t pad;
+};
+
+struct mon_get_arg {
+  struct usbmon_packet *hdr;
+  void *data;
+  size_t alloc;
+};
+
+#define MON_IOC_MAGIC 0x92
+#define MON_IOCT_RING_SIZE _IO(MON_IOC_MAGIC, 4)
+#define MON_IOCX_GETX _IOW(MON_IOC_MAGIC, 10, struct mon_get_arg)
+
+// Largest ring the kernel allows; a small ring loses events at high rates.
+const int kMonRingSize = 1200 * 1024;
+const size_t kMaxTransferBytes = 1200 * 1024;
+
+// Payload header bits (UVC 1.5, 2.4.3.3)
+const uint8_t kPayloadFid = 0x01;
+const uint8_t kPayloadEof = 0x02;
+const uint8_t kPayloadErr = 0x40;
+
+}
+
+PayloadCapture::PayloadCapture()
+  : mon_fd_(-1), fd_(-1), file_(NULL), bus_(0), address_(0),
+    stop_(false), format_set_(false), num_transfers_(0) {
+}
+
+PayloadCapture::~PayloadCapture() {
+  Stop();
+}
+
+bool PayloadCapture::Start(const std::string &path, int bus, int address) {
+  Stop();
+
+  char mon_path[32];
+  snprintf(mon_path, sizeof(mon_path), "/dev/usbmon%d", bus);
+  mon_fd_ = open(mon_path, O_RDONLY);
+  if (mon_fd_ < 0) {
+    ROS_WARN("Can't open %s for payload capture: %s (is the usbmon module loaded?)",
+             mon_path, strerror(errno));
+    return false;
+  }
+  ioctl(mon_fd_, MON_IOCT_RING_SIZE, kMonRingSize);
+
+  file_ = fopen(path.c_str(), "wb");
+  if (!file_) {
+    ROS_WARN("Can't open payload capture file %s: %s", path.c_str(), strerror(errno));
+    close(mon_fd_);
+    mon_fd_ = -1;
+    return false;
+  }
+
+  // The header is rewritten in place by SetFormat, so it must reach the file
+  // before any buffered transfer data does.
+  PayloadCaptureHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kPayloadCaptureMagic, sizeof(header.magic));
+  header.version = kPayloadCaptureVersion;
+  fwrite(&header, sizeof(header), 1, file_);
+  fflush(file_);
+
+  fd_ = fileno(file_);
+  bus_ = bus;
+  address_ = address;
+  stop_ = false;
+  format_set_ = false;
+  num_transfers_ = 0;
+  thread_ = boost::thread(boost::bind(&PayloadCapture::CaptureLoop, this));
+
+  ROS_INFO("Capturing streaming payloads of device %03d/%03d to %s",
+           bus, address, path.c_str());
+  return true;
+}
+
+void PayloadCapture::Stop() {
+  if (fd_ < 0)
+    return;
+
+  stop_ = true;
+  thread_.join();
+
+  fclose(file_);
+  file_ = NULL;
+  fd_ = -1;
+
+  close(mon_fd_);
+  mon_fd_ = -1;
+
+  ROS_INFO("Captured %lu streaming transfers", num_transfers_);
+}
+
+void PayloadCapture::SetFormat(enum uvc_frame_format format, int width, int height) {
+  if (fd_ < 0 || format_set_)
+    return;
+  format_set_ = true;
+
+  PayloadCaptureHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kPayloadCaptureMagic, sizeof(header.magic));
+  header.version = kPayloadCaptureVersion;
+  header.frame_format = format;
+  header.width = width;
+  header.height = height;
+
+  // pwrite leaves the stream position used by the capture thread alone.
+  if (pwrite(fd_, &header, sizeof(header), 0) != sizeof(header))
+    ROS_WARN("Couldn't write payload capture header: %s", strerror(errno));
+}
+
+void PayloadCapture::CaptureLoop() {
+  std::vector<uint8_t> data(kMaxTransferBytes);
+  usbmon_packet hdr;
+  mon_get_arg arg;
+  arg.hdr = &hdr;
+  arg.data = &data[0];
+  arg.alloc = data.size();
+
+  struct pollfd pfd;
+  pfd.fd = mon_fd_;
+  pfd.events = POLLIN;
+
+  while (!stop_) {
+    // Wake up periodically to notice Stop().
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+
+    if (ioctl(mon_fd_, MON_IOCX_GETX, &arg) < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      ROS_WARN("usbmon read failed, stopping payload capture: %s", strerror(errno));
+      break;
+    }
+
+    // Completed IN transfers on this device's streaming endpoints only
+    if (hdr.type != 'C' || hdr.busnum != bus_ || hdr.devnum != address_ ||
+        !(hdr.epnum & 0x80) ||
+        (hdr.xfer_type != kPayloadTransferIso && hdr.xfer_type != kPayloadTransferBulk))
+      continue;
+
+    size_t captured = std::min((size_t) hdr.len_cap, data.size());
+    size_t desc_bytes = (size_t) hdr.ndesc * sizeof(usbmon_isodesc);
+    if (desc_bytes > captured)
+      continue;
+
+    PayloadCaptureRecord record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp_ns = (uint64_t) hdr.ts_sec * 1000000000ull + (uint64_t) hdr.ts_usec * 1000ull;
+    record.status = hdr.status;
+    record.transfer_type = hdr.xfer_type;
+    record.endpoint = hdr.epnum;
+    record.num_packets = hdr.ndesc;
+    record.data_bytes = captured - desc_bytes;
+    fwrite(&record, sizeof(record), 1, file_);
+
+    const usbmon_isodesc *descs = reinterpret_cast<const usbmon_isodesc*>(&data[0]);
+    for (uint32_t i = 0; i < hdr.ndesc; ++i) {
+      PayloadCapturePacket packet;
+      packet.status = descs[i].iso_status;
+      packet.offset = descs[i].iso_off;
+      packet.length = descs[i].iso_len;
+      packet.reserved = 0;
+      fwrite(&packet, sizeof(packet), 1, file_);
+    }
+
+    fwrite(&data[desc_bytes], 1, record.data_bytes, file_);
+    ++num_transfers_;
+  }
+}
+
+PayloadAssembler::PayloadAssembler(enum uvc_frame_format format, int width, int height,
+                                   size_t max_frame_bytes, const FrameCallback &callback)
+  : callback_(callback), buffer_(max_frame_bytes), got_bytes_(0), fid_(0), sequence_(0) {
+  memset(&frame_, 0, sizeof(frame_));
+  frame_.frame_format = format;
+  frame_.width = width;
+  frame_.height = height;
+  frame_.library_owns_data = 0;
+  switch (format) {
+  case UVC_FRAME_FORMAT_YUYV:
+  case UVC_FRAME_FORMAT_UYVY:
+    frame_.step = width * 2;
+    break;
+  case UVC_FRAME_FORMAT_RGB:
+  case UVC_FRAME_FORMAT_BGR:
+    frame_.step = width * 3;
+    break;
+  default:
+    frame_.step = 0;
+    break;
+  }
+
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+void PayloadAssembler::ProcessTransfer(const PayloadCaptureRecord &record,
+                                       const PayloadCapturePacket *packets,
+                                       const uint8_t *data) {
+  if (record.transfer_type == kPayloadTransferBulk) {
+    // libuvc treats each bulk transfer as a single payload.
+    ProcessPayload(data, record.data_bytes);
+    return;
+  }
+
+  for (uint32_t i = 0; i < record.num_packets; ++i) {
+    if (packets[i].status != 0) {
+      ++stats_.packet_errors;
+      continue;
+    }
+    if ((uint64_t) packets[i].offset + packets[i].length > record.data_bytes) {
+      ++stats_.packet_errors;
+      continue;
+    }
+    ProcessPayload(data + packets[i].offset, packets[i].length);
+  }
+}
+
+void PayloadAssembler::ProcessPayload(const uint8_t *payload, size_t length) {
+  if (length == 0)
+    return;
+
+  ++stats_.payloads;
+
+  size_t header_len = payload[0];
+  if (header_len > length || header_len < 2) {
+    ++stats_.header_errors;
+    return;
+  }
+
+  uint8_t header_info = payload[1];
+  if (header_info & kPayloadErr) {
+    ++stats_.error_bit;
+    return;
+  }
+
+  // The FID flipped while data is pending: the camera never sent an EOF for
+  // the previous frame.
+  if (fid_ != (header_info & kPayloadFid) && got_bytes_ != 0) {
+    ++stats_.fid_toggles;
+    EmitFrame();
+  }
+  fid_ = header_info & kPayloadFid;
+
+  size_t data_len = length - header_len;
+  if (data_len == 0)
+    return;
+
+  if (got_bytes_ + data_len > buffer_.size()) {
+    ++stats_.overflows;
+    data_len = buffer_.size() - got_bytes_;
+  }
+  memcpy(&buffer_[0] + got_bytes_, payload + header_len, data_len);
+  got_bytes_ += data_len;
+
+  if (header_info & kPayloadEof) {
+    ++stats_.eof_frames;
+    EmitFrame();
+  }
+}
+
+void PayloadAssembler::EmitFrame() {
+  frame_.data = &buffer_[0];
+  frame_.data_bytes = got_bytes_;
+  frame_.sequence = ++sequence_;
+  got_bytes_ = 0;
+
+  callback_(&frame_);
+}
+
+};
@@ -0,0 +1,168 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+// Replays a payload capture (~payload_capture_file) through frame assembly
+// and CameraDriver's conversion and publishing path as fast as possible.
+//
+// usage: payload_replay <capture file> [_loops:=N] [_assemble_only:=true]
+#include <ros/ros.h>
+#include <boost/bind.hpp>
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "libuvc_camera/camera_driver.h"
+#include "libuvc_camera/payload_capture.h"
+
+namespace {
+
+struct FrameSink {
+  libuvc_camera::CameraDriver *driver;  // NULL to only assemble
+  unsigned long frames;
+  unsigned long bytes;
+
+  void OnFrame(uvc_frame_t *frame) {
+    ++frames;
+    bytes += frame->data_bytes;
+    if (driver)
+      driver->ReplayFrame(frame);
+  }
+};
+
+bool ReadFile(const char *path, std::vector<uint8_t> *contents) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  contents->resize(size > 0 ? size : 0);
+  bool ok = size > 0 && fread(&(*contents)[0], 1, size, file) == (size_t) size;
+  fclose(file);
+  return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "payload_replay");
+  ros::NodeHandle nh;
+  ros::NodeHandle priv_nh("~");
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <capture file> [_loops:=N] [_assemble_only:=true]\n", argv[0]);
+    return 1;
+  }
+
+  int loops;
+  bool assemble_only;
+  priv_nh.param("loops", loops, 1);
+  priv_nh.param("assemble_only", assemble_only, false);
+
+  std::vector<uint8_t> capture;
+  if (!ReadFile(argv[1], &capture) ||
+      capture.size() < sizeof(libuvc_camera::PayloadCaptureHeader)) {
+    ROS_ERROR("Can't read payload capture %s", argv[1]);
+    return 1;
+  }
+
+  libuvc_camera::PayloadCaptureHeader header;
+  memcpy(&header, &capture[0], sizeof(header));
+  if (memcmp(header.magic, libuvc_camera::kPayloadCaptureMagic, sizeof(header.magic)) != 0 ||
+      header.version != libuvc_camera::kPayloadCaptureVersion) {
+    ROS_ERROR("%s is not a version %u payload capture", argv[1],
+              libuvc_camera::kPayloadCaptureVersion);
+    return 1;
+  }
+  if (header.width == 0 || header.height == 0) {
+    ROS_ERROR("%s has no stream format; no frame was delivered while capturing", argv[1]);
+    return 1;
+  }
+
+  libuvc_camera::CameraDriver driver(nh, priv_nh);
+  driver.StartReplay(header.width, header.height);
+
+  FrameSink sink;
+  sink.driver = assemble_only ? NULL : &driver;
+  sink.frames = 0;
+  sink.bytes = 0;
+
+  libuvc_camera::PayloadAssembler assembler(
+    (enum uvc_frame_format) header.frame_format, header.width, header.height,
+    header.width * header.height * 4,
+    boost::bind(&FrameSink::OnFrame, &sink, _1));
+
+  unsigned long transfers = 0;
+  ros::WallTime start = ros::WallTime::now();
+
+  for (int loop = 0; loop < loops && ros::ok(); ++loop) {
+    size_t offset = sizeof(header);
+    while (offset + sizeof(libuvc_camera::PayloadCaptureRecord) <= capture.size()) {
+      libuvc_camera::PayloadCaptureRecord record;
+      memcpy(&record, &capture[offset], sizeof(record));
+      offset += sizeof(record);
+
+      size_t packet_bytes = record.num_packets * sizeof(libuvc_camera::PayloadCapturePacket);
+      if (offset + packet_bytes + record.data_bytes > capture.size()) {
+        ROS_WARN("Capture truncated after %lu transfers", transfers);
+        break;
+      }
+
+      std::vector<libuvc_camera::PayloadCapturePacket> packets(record.num_packets);
+      if (packet_bytes)
+        memcpy(&packets[0], &capture[offset], packet_bytes);
+      offset += packet_bytes;
+
+      assembler.ProcessTransfer(record, packets.empty() ? NULL : &packets[0], &capture[offset]);
+      offset += record.data_bytes;
+      ++transfers;
+    }
+  }
+
+  double seconds = (ros::WallTime::now() - start).toSec();
+  const libuvc_camera::PayloadAssembler::Stats &stats = assembler.GetStats();
+
+  printf("%lu transfers, %lu payloads -> %lu frames in %.3f s (%.1f fps, %.1f MB/s)%s\n",
+         transfers, stats.payloads, sink.frames, seconds,
+         seconds > 0 ? sink.frames / seconds : 0.0,
+         seconds > 0 ? sink.bytes / seconds / 1e6 : 0.0,
+         assemble_only ? " [assembly only]" : "");
+  printf("frames ended by EOF: %lu, by FID toggle: %lu\n", stats.eof_frames, stats.fid_toggles);
+  printf("packet errors: %lu, header errors: %lu, ERR bit: %lu, overflows: %lu\n",
+         stats.packet_errors, stats.header_errors, stats.error_bit, stats.overflows);
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+// Lists the frames of a recording written by FrameRecorder (~record_file)
+// as CSV and optionally decompresses them, one raw file per frame.
+//
+// usage: record_decode [--extract <directory>] <recording>
+//
+// Frames are listed in sequence order from the index when the recording
+// was closed cleanly, otherwise in file order by walking the entries.
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef LIBUVC_CAMERA_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef LIBUVC_CAMERA_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "libuvc_camera/frame_recorder.h"
+
+using libuvc_camera::FrameRecordingEntry;
+using libuvc_camera::FrameRecordingHeader;
+using libuvc_camera::FrameRecordingIndexEntry;
+using libuvc_camera::FrameRecordingTrailer;
+
+namespace {
+
+// Offsets of the frames' entries, from the index if there is one.
+bool ReadOffsets(FILE *file, std::vector<uint64_t> *offsets) {
+  FrameRecordingTrailer trailer;
+  if (fseeko(file, -(off_t) sizeof(trailer), SEEK_END) == 0 &&
+      fread(&trailer, sizeof(trailer), 1, file) == 1 &&
+      memcmp(trailer.magic, libuvc_camera::kFrameRecordingIndexMagic,
+             sizeof(trailer.magic)) == 0) {
+    std::vector<FrameRecordingIndexEntry> index(trailer.num_frames);
+    if (fseeko(file, trailer.index_offset, SEEK_SET) == 0 &&
+        (index.empty() ||
+         fread(&index[0], sizeof(index[0]), index.size(), file) == index.size())) {
+      for (size_t i = 0; i < index.size(); ++i)
+        offsets->push_back(index[i].offset);
+      return true;
+    }
+  }
+
+  // No trailer: the recorder didn't get to Close(). Walk the entries up to
+  // the last complete one.
+  fseeko(file, 0, SEEK_END);
+  uint64_t size = ftello(file);
+  uint64_t offset = sizeof(FrameRecordingHeader);
+  FrameRecordingEntry entry;
+  while (fseeko(file, offset, SEEK_SET) == 0 &&
+         fread(&entry, sizeof(entry), 1, file) == 1 &&
+         offset + sizeof(entry) + entry.compressed_bytes <= size) {
+    offsets->push_back(offset);
+    offset += sizeof(entry) + entry.compressed_bytes;
+  }
+  return false;
+}
+
+bool Decompress(uint32_t codec, const std::vector<uint8_t> &compressed,
+                std::vector<uint8_t> *raw) {
+  switch (codec) {
+#ifdef LIBUVC_CAMERA_HAVE_LZ4
+  case libuvc_camera::kFrameRecordingLz4:
+    return LZ4_decompress_safe(reinterpret_cast<const char*>(&compressed[0]),
+                               reinterpret_cast<char*>(&(*raw)[0]),
+                               (int) compressed.size(), (int) raw->size()) == (int) raw->size();
+#endif
+#ifdef LIBUVC_CAMERA_HAVE_ZSTD
+  case libuvc_camera::kFrameRecordingZstd:
+    return ZSTD_decompress(&(*raw)[0], raw->size(),
+                           &compressed[0], compressed.size()) == raw->size();
+#endif
+  default:
+    return false;
+  }
+}
+
+}
+
+int main(int argc, char **argv) {
+  const char *extract_dir = NULL;
+  const char *path = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--extract") == 0 && i + 1 < argc)
+      extract_dir = argv[++i];
+    else
+      path = argv[i];
+  }
+
+  if (!path) {
+    fprintf(stderr, "usage: %s [--extract <directory>] <recording>\n", argv[0]);
+    return 1;
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+
+  FrameRecordingHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, libuvc_camera::kFrameRecordingMagic, sizeof(header.magic)) != 0 ||
+      header.version != libuvc_camera::kFrameRecordingVersion) {
+    fprintf(stderr, "%s: not a version %u frame recording\n", path,
+            libuvc_camera::kFrameRecordingVersion);
+    fclose(file);
+    return 1;
+  }
+
+  std::vector<uint64_t> offsets;
+  if (!ReadOffsets(file, &offsets))
+    fprintf(stderr, "%s: no index, recording wasn't closed; listing %lu complete frames\n",
+            path, (unsigned long) offsets.size());
+
+  int status = 0;
+  std::vector<uint8_t> compressed, raw;
+  printf("sequence,stamp_ns,frame_format,width,height,step,raw_bytes,compressed_bytes,offset\n");
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    FrameRecordingEntry entry;
+    if (fseeko(file, offsets[i], SEEK_SET) != 0 || fread(&entry, sizeof(entry), 1, file) != 1) {
+      fprintf(stderr, "%s: truncated entry at %llu\n", path, (unsigned long long) offsets[i]);
+      status = 1;
+      break;
+    }
+    printf("%u,%llu,%u,%u,%u,%u,%u,%u,%llu\n", entry.sequence,
+           (unsigned long long) entry.stamp_ns, entry.frame_format, entry.width, entry.height,
+           entry.step, entry.raw_bytes, entry.compressed_bytes,
+           (unsigned long long) offsets[i]);
+
+    if (!extract_dir || entry.compressed_bytes == 0)
+      continue;
+
+    compressed.resize(entry.compressed_bytes);
+    raw.resize(entry.raw_bytes);
+    if (fread(&compressed[0], 1, compressed.size(), file) != compressed.size() ||
+        !Decompress(header.codec, compressed, &raw)) {
+      fprintf(stderr, "%s: can't decompress frame %u (codec %u built in?)\n",
+              path, entry.sequence, header.codec);
+      status = 1;
+      continue;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/%010u.raw", entry.sequence);
+    std::string out_path = std::string(extract_dir) + name;
+    FILE *out = fopen(out_path.c_str(), "wb");
+    if (!out || (!raw.empty() && fwrite(&raw[0], 1, raw.size(), out) != raw.size())) {
+      perror(out_path.c_str());
+      status = 1;
+    }
+    if (out)
+      fclose(out);
+  }
+
+  fclose(file);
+  return status;
+}
@@ -0,0 +1,219 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+#include "libuvc_camera/software_isp.h"
+
+#include <math.h>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace libuvc_camera {
+
+namespace {
+
+// Matrix coefficients have 10 fractional bits, which limits them to +-32.
+// Matrix outputs keep 4 fractional bits going into the gamma table, so dark
+// tones don't band after a strong gamma.
+const int kCoefficientBits = 10;
+const int kFractionBits = 4;
+const int kOutputShift = kCoefficientBits - kFractionBits;
+const int kToneEntries = 256 << kFractionBits;
+
+inline uint8_t ToneCurve(double value, double gamma) {
+  value = std::max(0.0, std::min(value, 255.0));
+  return (uint8_t) (255.0 * pow(value / 255.0, 1.0 / gamma) + 0.5);
+}
+
+inline int ToneIndex(int sum) {
+  return std::max(0, std::min((sum + (1 << (kOutputShift - 1))) >> kOutputShift,
+                              kToneEntries - 1));
+}
+
+// Pixels [begin, end) of a row of 3- or 4-byte pixels
+void ApplyMatrixScalar(const int16_t *k, const uint8_t *tone, uint8_t *row,
+                       int begin, int end, int channels, const int *offset) {
+  uint8_t *p = row + begin * channels;
+  for (int x = begin; x < end; ++x, p += channels) {
+    int r = p[offset[0]], g = p[1], b = p[offset[2]];
+    for (int out = 0; out < 3; ++out)
+      p[offset[out]] = tone[ToneIndex(k[out * 3] * r + k[out * 3 + 1] * g + k[out * 3 + 2] * b)];
+  }
+}
+
+#ifdef __SSE2__
+// Four 4-byte pixels at a time; returns the first pixel left for the scalar
+// tail.
+int ApplyMatrixSse2(const int16_t *k, const uint8_t *tone, uint8_t *row,
+                    int width, const int *offset) {
+  // Per output channel, the coefficients in the byte order of a pixel pair,
+  // with zero for the fourth byte.
+  __m128i coefficients[3];
+  for (int out = 0; out < 3; ++out) {
+    int16_t lanes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (int in = 0; in < 3; ++in)
+      lanes[offset[in]] = lanes[offset[in] + 4] = k[out * 3 + in];
+    coefficients[out] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes));
+  }
+
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << (kOutputShift - 1));
+  const __m128i max_index = _mm_set1_epi16(kToneEntries - 1);
+
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    uint8_t *p = row + x * 4;
+    const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const __m128i lo = _mm_unpacklo_epi8(pixels, zero);  // Pixels 0 and 1
+    const __m128i hi = _mm_unpackhi_epi8(pixels, zero);  // Pixels 2 and 3
+
+    // One 32-bit sum per pixel and output channel
+    __m128i sums[3];
+    for (int out = 0; out < 3; ++out) {
+      // madd leaves two partial sums per pixel; fold them into the even lanes
+      __m128i a = _mm_madd_epi16(lo, coefficients[out]);
+      __m128i b = _mm_madd_epi16(hi, coefficients[out]);
+      a = _mm_shuffle_epi32(_mm_add_epi32(a, _mm_srli_epi64(a, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+      b = _mm_shuffle_epi32(_mm_add_epi32(b, _mm_srli_epi64(b, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+      sums[out] = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi64(a, b), round), kOutputShift);
+    }
+
+    // Clamp to tone_ indices as 16-bit lanes: channel-major, 4 pixels each
+    int16_t index[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(index),
+                     _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(sums[0], sums[1]), zero),
+                                   max_index));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(index + 8),
+                     _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(sums[2], zero), zero),
+                                   max_index));
+
+    // No gather in SSE2; the gamma lookups stay scalar.
+    for (int i = 0; i < 4; ++i) {
+      p[i * 4 + offset[0]] = tone[index[i]];
+      p[i * 4 + offset[1]] = tone[index[4 + i]];
+      p[i * 4 + offset[2]] = tone[index[8 + i]];
+    }
+  }
+  return x;
+}
+#endif
+
+}
+
+SoftwareIsp::Options::Options()
+  : gamma(1.0) {
+  for (int i = 0; i < 3; ++i)
+    gains[i] = 1.0;
+  for (int i = 0; i < 9; ++i)
+    matrix[i] = (i % 4 == 0) ? 1.0 : 0.0;
+}
+
+SoftwareIsp::SoftwareIsp()
+  : configured_(false), diagonal_(true) {
+  std::fill(coefficients_, coefficients_ + 9, 0);
+}
+
+void SoftwareIsp::Configure(const Options &options) {
+  if (configured_ &&
+      std::equal(options.gains, options.gains + 3, options_.gains) &&
+      std::equal(options.matrix, options.matrix + 9, options_.matrix) &&
+      options.gamma == options_.gamma)
+    return;
+
+  options_ = options;
+  configured_ = true;
+  double gamma = options.gamma > 0.0 ? options.gamma : 1.0;
+
+  diagonal_ = true;
+  for (int i = 0; i < 9; ++i) {
+    if (i % 4 != 0 && options.matrix[i] != 0.0)
+      diagonal_ = false;
+  }
+
+  if (diagonal_) {
+    channels_.resize(3 * 256);
+    for (int c = 0; c < 3; ++c) {
+      double scale = options.gains[c] * options.matrix[c * 4];
+      for (int v = 0; v < 256; ++v)
+        channels_[c * 256 + v] = ToneCurve(v * scale, gamma);
+    }
+    return;
+  }
+
+  for (int out = 0; out < 3; ++out) {
+    for (int in = 0; in < 3; ++in) {
+      double value = floor(options.matrix[out * 3 + in] * options.gains[in] *
+                           (1 << kCoefficientBits) + 0.5);
+      coefficients_[out * 3 + in] = (int16_t) std::max(-32768.0, std::min(value, 32767.0));
+    }
+  }
+
+  tone_.resize(kToneEntries);
+  for (int x = 0; x < kToneEntries; ++x)
+    tone_[x] = ToneCurve((double) x / (1 << kFractionBits), gamma);
+}
+
+void SoftwareIsp::Apply(uint8_t *pixels, size_t step, int width, int height,
+                        int channels, bool red_first) const {
+  if (!configured_)
+    return;
+
+  // Byte offsets of red, green and blue within a pixel
+  const int offset[3] = { red_first ? 0 : 2, 1, red_first ? 2 : 0 };
+
+  if (diagonal_) {
+    const uint8_t *red = &channels_[0], *green = &channels_[256], *blue = &channels_[512];
+    for (int y = 0; y < height; ++y, pixels += step) {
+      uint8_t *p = pixels;
+      for (int x = 0; x < width; ++x, p += channels) {
+        p[offset[0]] = red[p[offset[0]]];
+        p[1] = green[p[1]];
+        p[offset[2]] = blue[p[offset[2]]];
+      }
+    }
+    return;
+  }
+
+  for (int y = 0; y < height; ++y, pixels += step) {
+    int x = 0;
+#ifdef __SSE2__
+    if (channels == 4)
+      x = ApplyMatrixSse2(coefficients_, &tone_[0], pixels, width, offset);
+#endif
+    ApplyMatrixScalar(coefficients_, &tone_[0], pixels, x, width, channels, offset);
+  }
+}
+
+};
@@ -0,0 +1,148 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (C) 2012 Ken Tossell
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the author nor other contributors may be
+*     used to endorse or promote products derived from this software
+*     without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+// Converts a frame trace file written by CameraDriver (~trace_file) to CSV
+// or to Chrome trace JSON (chrome://tracing, Perfetto).
+//
+// usage: trace_decode [--chrome] <trace file>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "libuvc_camera/frame_tracer.h"
+
+using libuvc_camera::FrameTraceHeader;
+using libuvc_camera::FrameTraceRecord;
+
+namespace {
+
+bool ByIndex(const FrameTraceRecord &a, const FrameTraceRecord &b) {
+  return a.index < b.index;
+}
+
+// Emits a complete ("X") event spanning [start, end] if both were recorded.
+void PrintChromeSpan(const char *name, uint64_t start, uint64_t end,
+                     const FrameTraceRecord &record, bool *first) {
+  if (start == 0 || end == 0 || end < start)
+    return;
+
+  printf("%s\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+         "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"sequence\": %u, \"bytes\": %u}}",
+         *first ? "" : ",", name, start / 1000.0, (end - start) / 1000.0,
+         record.sequence, record.payload_bytes);
+  *first = false;
+}
+
+}
+
+int main(int argc, char **argv) {
+  bool chrome = false;
+  const char *path = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--chrome") == 0)
+      chrome = true;
+    else
+      path = argv[i];
+  }
+
+  if (!path) {
+    fprintf(stderr, "usage: %s [--chrome] <trace file>\n", argv[0]);
+    return 1;
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+
+  FrameTraceHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, libuvc_camera::kFrameTraceMagic, sizeof(header.magic)) != 0 ||
+      header.version != libuvc_camera::kFrameTraceVersion ||
+      header.record_size != sizeof(FrameTraceRecord)) {
+    fprintf(stderr, "%s: not a version %u frame trace\n", path, libuvc_camera::kFrameTraceVersion);
+    fclose(file);
+    return 1;
+  }
+  if (header.capacity == 0) {
+    fprintf(stderr, "%s: frame trace has no records\n", path);
+    fclose(file);
+    return 1;
+  }
+
+  std::vector<FrameTraceRecord> records(header.capacity);
+  size_t num_read = fread(&records[0], sizeof(FrameTraceRecord), header.capacity, file);
+  fclose(file);
+  records.resize(num_read);
+
+  // Drop empty and in-flight slots, then restore claim order across the ring.
+  std::vector<FrameTraceRecord> committed;
+  for (size_t i = 0; i < records.size(); ++i) {
+    if (records[i].index != 0)
+      committed.push_back(records[i]);
+  }
+  std::sort(committed.begin(), committed.end(), ByIndex);
+
+  if (chrome) {
+    bool first = true;
+    printf("{\"traceEvents\": [");
+    for (size_t i = 0; i < committed.size(); ++i) {
+      const FrameTraceRecord &r = committed[i];
+      PrintChromeSpan("usb_to_callback", r.usb_receive_ns, r.callback_ns, r, &first);
+      PrintChromeSpan("queued", r.callback_ns, r.convert_start_ns, r, &first);
+      PrintChromeSpan("convert", r.convert_start_ns, r.convert_end_ns, r, &first);
+      PrintChromeSpan("first_strip", r.convert_start_ns, r.first_strip_ns, r, &first);
+      PrintChromeSpan("publish", r.convert_end_ns, r.publish_end_ns, r, &first);
+    }
+    printf("\n], \"displayTimeUnit\": \"ms\"}\n");
+  } else {
+    printf("index,sequence,payload_bytes,usb_receive_ns,callback_ns,"
+           "convert_start_ns,convert_end_ns,publish_end_ns,first_strip_ns\n");
+    for (size_t i = 0; i < committed.size(); ++i) {
+      const FrameTraceRecord &r = committed[i];
+      printf("%llu,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu\n",
+             (unsigned long long) r.index, r.sequence, r.payload_bytes,
+             (unsigned long long) r.usb_receive_ns,
+             (unsigned long long) r.callback_ns,
+             (unsigned long long) r.convert_start_ns,
+             (unsigned long long) r.convert_end_ns,
+             (unsigned long long) r.publish_end_ns,
+             (unsigned long long) r.first_strip_ns);
+    }
+  }
+
+  return 0;
+}